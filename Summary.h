@@ -0,0 +1,135 @@
+//===- Summary.h - Per-TU summary containers and symbol hashes ------------===//
+//
+// Containers for the summary of a translation unit and the hash that
+// identifies symbols across translation units. They do not depend on clang,
+// so the benchmarks in bench/ use them too.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef XUNUSED_SUMMARY_H
+#define XUNUSED_SUMMARY_H
+
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+template <class T, class Alloc, class Predicate>
+void discard_if(std::vector<T, Alloc> &c, Predicate pred) {
+  c.erase(std::remove_if(c.begin(), c.end(), pred), c.end());
+}
+
+/// Sorts \p c and removes duplicates, so it can be used as input to
+/// std::set_difference.
+template <class T, class Alloc> void sort_unique(std::vector<T, Alloc> &c) {
+  std::sort(c.begin(), c.end());
+  c.erase(std::unique(c.begin(), c.end()), c.end());
+}
+
+/// Per-thread bump allocator for the summary of the translation unit that
+/// the thread is currently processing. It is reset as a whole once the
+/// summary has been merged into AllDecls.
+inline thread_local llvm::BumpPtrAllocator SummaryArena;
+
+/// STL allocator that allocates from the SummaryArena of the current thread.
+/// Memory is only released by resetting the arena.
+template <class T> struct ArenaAllocator {
+  using value_type = T;
+
+  ArenaAllocator() = default;
+  template <class U> ArenaAllocator(const ArenaAllocator<U> &) {}
+
+  T *allocate(size_t N) { return SummaryArena.Allocate<T>(N); }
+  void deallocate(T *, size_t) {}
+
+  bool operator==(const ArenaAllocator &) const { return true; }
+  bool operator!=(const ArenaAllocator &) const { return false; }
+};
+
+template <class T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+/// A stable 128-bit identity of a declaration. It is the hash of the
+/// declaration's USR, so two declarations have the same SymbolHash exactly
+/// when they have the same USR (up to hash collisions).
+struct SymbolHash {
+  uint64_t High = 0;
+  uint64_t Low = 0;
+
+  bool operator==(const SymbolHash &O) const {
+    return High == O.High && Low == O.Low;
+  }
+  bool operator!=(const SymbolHash &O) const { return !(*this == O); }
+  bool operator<(const SymbolHash &O) const {
+    return High < O.High || (High == O.High && Low < O.Low);
+  }
+};
+
+namespace llvm {
+template <> struct DenseMapInfo<SymbolHash> {
+  static SymbolHash getEmptyKey() { return {~0ULL, ~0ULL}; }
+  static SymbolHash getTombstoneKey() { return {~0ULL, ~0ULL - 1}; }
+  static unsigned getHashValue(const SymbolHash &H) {
+    return static_cast<unsigned>(H.Low ^ (H.Low >> 32));
+  }
+  static bool isEqual(const SymbolHash &A, const SymbolHash &B) {
+    return A == B;
+  }
+};
+} // namespace llvm
+
+/// A raw_ostream that feeds everything written to it into a SymbolHash
+/// instead of storing it. The result does not depend on how the output is
+/// split into writes, so hashing a USR piece by piece gives the same value as
+/// hashing the complete string.
+class SymbolHashStream : public llvm::raw_ostream {
+public:
+  SymbolHashStream() { SetBuffer(Buffer, sizeof(Buffer)); }
+  ~SymbolHashStream() override { flush(); }
+
+  SymbolHash result() {
+    flush();
+    uint64_t H = High, L = Low;
+    mix(H, L, Pending ^ (Length << 56));
+    return {fmix(H ^ (L >> 1)), fmix(L + H)};
+  }
+
+private:
+  static uint64_t fmix(uint64_t K) {
+    K ^= K >> 33;
+    K *= 0xff51afd7ed558ccdULL;
+    K ^= K >> 33;
+    K *= 0xc4ceb9fe1a85ec53ULL;
+    K ^= K >> 33;
+    return K;
+  }
+
+  static void mix(uint64_t &H, uint64_t &L, uint64_t Word) {
+    L = (L ^ Word) * 0x9e3779b97f4a7c15ULL;
+    L ^= L >> 31;
+    H = (H + Word) * 0xc2b2ae3d27d4eb4fULL;
+    H = ((H << 27) | (H >> 37)) ^ L;
+  }
+
+  void write_impl(const char *Ptr, size_t Size) override {
+    for (size_t I = 0; I != Size; ++I) {
+      Pending |= uint64_t(static_cast<unsigned char>(Ptr[I]))
+                 << (8 * (Length % 8));
+      if (++Length % 8 == 0) {
+        mix(High, Low, Pending);
+        Pending = 0;
+      }
+    }
+  }
+
+  uint64_t current_pos() const override { return Length; }
+
+  char Buffer[128];
+  uint64_t High = 0x6a09e667f3bcc908ULL;
+  uint64_t Low = 0xbb67ae8584caa73bULL;
+  uint64_t Pending = 0;
+  uint64_t Length = 0;
+};
+
+#endif // XUNUSED_SUMMARY_H
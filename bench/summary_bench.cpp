@@ -0,0 +1,218 @@
+//===- summary_bench.cpp - Benchmarks of the summary data structures ------===//
+//
+// Times the per-TU summaries and the global symbol table on synthetic
+// declarations, against the data structures they replaced:
+//
+//  - Defs and Uses of a translation unit collected in std::set, versus
+//    ArenaVectors that are sorted and deduplicated once, followed by
+//    dropping weak definitions and the set_difference of the two.
+//  - The symbol table keyed by USR strings in a std::map, versus a
+//    DenseMap keyed by the SymbolHash that is streamed from the USR pieces
+//    without materializing the string.
+//
+// The default sizes are those of a large translation unit and of a project
+// with a few hundred of them; they can be changed on the command line.
+//
+//===----------------------------------------------------------------------===//
+
+#include "../Summary.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+
+static llvm::cl::opt<unsigned>
+    NumDefs("defs", llvm::cl::desc("Definitions per translation unit"),
+            llvm::cl::init(20000));
+static llvm::cl::opt<unsigned>
+    NumUses("uses", llvm::cl::desc("Uses per translation unit"),
+            llvm::cl::init(200000));
+static llvm::cl::opt<unsigned>
+    NumDecls("decls",
+             llvm::cl::desc("Distinct declarations visible in a translation "
+                            "unit, including those from headers"),
+             llvm::cl::init(60000));
+static llvm::cl::opt<unsigned>
+    NumTUs("tus", llvm::cl::desc("Translation units of the project"),
+           llvm::cl::init(200));
+static llvm::cl::opt<unsigned>
+    NumHeaderSymbols("header-symbols",
+                     llvm::cl::desc("Symbols of the project's headers"),
+                     llvm::cl::init(50000));
+static llvm::cl::opt<unsigned> SymbolsPerTU(
+    "symbols-per-tu",
+    llvm::cl::desc("Header symbols that each translation unit reports"),
+    llvm::cl::init(20000));
+
+namespace {
+
+/// Stands in for a FunctionDecl; only its address is used.
+struct FakeDecl {
+  unsigned Id;
+  bool Weak;
+};
+
+/// Stands in for DefInfo.
+struct Record {
+  bool Defined = false;
+  unsigned Uses = 0;
+
+  void merge(const Record &Other) {
+    Defined |= Other.Defined;
+    Uses += Other.Uses;
+  }
+};
+
+template <class Fn> double timeMs(Fn &&F) {
+  auto Begin = std::chrono::steady_clock::now();
+  F();
+  auto End = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(End - Begin).count();
+}
+
+/// The declarations that one translation unit defines and uses, in the
+/// order in which the matchers would report them.
+struct TUInput {
+  std::vector<const FakeDecl *> Defs;
+  std::vector<const FakeDecl *> Uses;
+};
+
+TUInput makeTU(const std::vector<FakeDecl> &Decls, std::mt19937 &Rng) {
+  TUInput TU;
+  std::uniform_int_distribution<size_t> Any(0, Decls.size() - 1);
+  for (unsigned I = 0; I != NumDefs; ++I)
+    TU.Defs.push_back(&Decls[Any(Rng)]);
+  // Uses are skewed: a few functions are called very often.
+  std::geometric_distribution<size_t> Hot(0.001);
+  for (unsigned I = 0; I != NumUses; ++I)
+    TU.Uses.push_back(&Decls[std::min(Hot(Rng), Decls.size() - 1)]);
+  return TU;
+}
+
+size_t collectWithSets(const TUInput &TU) {
+  std::set<const FakeDecl *> Defs(TU.Defs.begin(), TU.Defs.end());
+  std::set<const FakeDecl *> Uses;
+  for (const FakeDecl *D : TU.Uses)
+    Uses.insert(D);
+  for (auto It = Defs.begin(); It != Defs.end();)
+    It = (*It)->Weak ? Defs.erase(It) : std::next(It);
+  std::vector<const FakeDecl *> Unused;
+  std::set_difference(Defs.begin(), Defs.end(), Uses.begin(), Uses.end(),
+                      std::back_inserter(Unused));
+  return Unused.size();
+}
+
+size_t collectWithVectors(const TUInput &TU) {
+  size_t Result;
+  {
+    ArenaVector<const FakeDecl *> Defs, Uses;
+    for (const FakeDecl *D : TU.Defs)
+      Defs.push_back(D);
+    for (const FakeDecl *D : TU.Uses)
+      Uses.push_back(D);
+    sort_unique(Defs);
+    sort_unique(Uses);
+    discard_if(Defs, [](const FakeDecl *D) { return D->Weak; });
+    ArenaVector<const FakeDecl *> Unused;
+    std::set_difference(Defs.begin(), Defs.end(), Uses.begin(), Uses.end(),
+                        std::back_inserter(Unused));
+    Result = Unused.size();
+  }
+  SummaryArena.Reset();
+  return Result;
+}
+
+/// Writes a USR like those of methods in namespaces, in pieces like
+/// SymbolHasher does.
+void writeUSR(llvm::raw_ostream &OS, unsigned Symbol) {
+  OS << "c:@N@project@N@module" << Symbol % 97 << "@S@Class" << Symbol % 5003
+     << "@F@method" << Symbol << "#&1$@N@std@S@basic_string>#C#$@N@std@S@"
+     << "char_traits>#C#$@N@std@S@allocator>#C#";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv,
+                                    "Benchmarks of the xunused summaries\n");
+  std::mt19937 Rng(42);
+
+  std::vector<FakeDecl> Decls(NumDecls);
+  for (unsigned I = 0; I != NumDecls; ++I)
+    Decls[I] = {I, I % 10 == 0};
+  // Interleave the declarations in memory like an AST does.
+  std::shuffle(Decls.begin(), Decls.end(), Rng);
+
+  constexpr unsigned Repetitions = 20;
+  std::vector<TUInput> Inputs;
+  for (unsigned I = 0; I != Repetitions; ++I)
+    Inputs.push_back(makeTU(Decls, Rng));
+
+  size_t SetUnused = 0, VectorUnused = 0;
+  double SetMs = timeMs([&] {
+    for (const TUInput &TU : Inputs)
+      SetUnused += collectWithSets(TU);
+  });
+  double VectorMs = timeMs([&] {
+    for (const TUInput &TU : Inputs)
+      VectorUnused += collectWithVectors(TU);
+  });
+  if (SetUnused != VectorUnused) {
+    llvm::errs() << "error: the set and vector summaries differ\n";
+    return 1;
+  }
+  llvm::outs() << "per-TU summary (" << NumDefs << " defs, " << NumUses
+               << " uses): std::set "
+               << llvm::format("%.2f", SetMs / Repetitions)
+               << " ms, sorted vectors "
+               << llvm::format("%.2f", VectorMs / Repetitions) << " ms\n";
+
+  // Every TU reports a random subset of the header symbols and its own
+  // definitions, as the summaries of translation units do.
+  std::vector<std::vector<unsigned>> TUSymbols(NumTUs);
+  std::uniform_int_distribution<unsigned> Header(0, NumHeaderSymbols - 1);
+  unsigned NextOwn = NumHeaderSymbols;
+  for (auto &Symbols : TUSymbols) {
+    for (unsigned I = 0; I != SymbolsPerTU; ++I)
+      Symbols.push_back(Header(Rng));
+    for (unsigned I = 0; I != NumDefs / 10; ++I)
+      Symbols.push_back(NextOwn++);
+  }
+
+  std::map<std::string, Record> StringTable;
+  double StringMs = timeMs([&] {
+    for (const auto &Symbols : TUSymbols)
+      for (unsigned Symbol : Symbols) {
+        std::string USR;
+        llvm::raw_string_ostream OS(USR);
+        writeUSR(OS, Symbol);
+        OS.flush();
+        StringTable[std::move(USR)].merge({Symbol >= NumHeaderSymbols, 1});
+      }
+  });
+
+  llvm::DenseMap<SymbolHash, Record> HashTable;
+  double HashMs = timeMs([&] {
+    for (const auto &Symbols : TUSymbols)
+      for (unsigned Symbol : Symbols) {
+        SymbolHashStream OS;
+        writeUSR(OS, Symbol);
+        HashTable[OS.result()].merge({Symbol >= NumHeaderSymbols, 1});
+      }
+  });
+  if (StringTable.size() != HashTable.size()) {
+    llvm::errs() << "error: the string and hash tables differ\n";
+    return 1;
+  }
+  llvm::outs() << "symbol table (" << NumTUs << " TUs, "
+               << StringTable.size() << " symbols): std::map<std::string> "
+               << llvm::format("%.1f", StringMs)
+               << " ms, DenseMap<SymbolHash> " << llvm::format("%.1f", HashMs)
+               << " ms\n";
+  return 0;
+}
@@ -1,32 +1,108 @@
+#include "Summary.h"
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTContext.h"
+#include "clang/AST/ASTLambda.h"
+#include "clang/AST/Mangle.h"
+#include "clang/AST/ODRHash.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/Basic/Version.h"
 #include "clang/Driver/Options.h"
 #include "clang/Frontend/ASTConsumers.h"
+#include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Index/USRGeneration.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/Preprocessor.h"
 #include "clang/Tooling/AllTUsExecution.h"
+#include "clang/Tooling/Execution.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Parallel.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstring>
+#include <functional>
 #include <memory>
 #include <mutex>
-#include <map>
+#include <numeric>
+#include <tuple>
+#include <vector>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 
 using namespace clang;
 using namespace clang::ast_matchers;
 
-template <class T, class Comp, class Alloc, class Predicate>
-void discard_if(std::set<T, Comp, Alloc> &c, Predicate pred) {
-  for (auto it{c.begin()}, end{c.end()}; it != end;) {
-    if (pred(*it)) {
-      it = c.erase(it);
-    } else {
-      ++it;
-    }
+/// Allocator statistics, printed with -print-stats.
+struct AllocatorStats {
+  std::atomic<uint64_t> TUs{0};
+  std::atomic<uint64_t> ArenaBytes{0};
+  std::atomic<uint64_t> PeakArenaBytes{0};
+  std::atomic<uint64_t> HeapTrims{0};
+} Stats;
+
+static llvm::cl::opt<bool>
+    PrintStats("print-stats",
+               llvm::cl::desc("Print allocator statistics at the end"));
+
+void resetSummaryArena() {
+  uint64_t Bytes = SummaryArena.getBytesAllocated();
+  ++Stats.TUs;
+  Stats.ArenaBytes += Bytes;
+  uint64_t Peak = Stats.PeakArenaBytes;
+  while (Peak < Bytes &&
+         !Stats.PeakArenaBytes.compare_exchange_weak(Peak, Bytes)) {
+  }
+  SummaryArena.Reset();
+}
+
+static llvm::cl::opt<unsigned> TrimHeapThreshold(
+    "trim-heap-threshold",
+    llvm::cl::desc("Return free heap memory to the system after each "
+                   "translation unit whose AST took more than this many MiB "
+                   "(0 disables it)"),
+    llvm::cl::init(256));
+
+/// Size of the AST of the last translation unit processed by this thread.
+thread_local size_t LastASTMemory = 0;
+
+/// Called once the AST of a translation unit has been freed.
+void trimHeapAfterTU() {
+#if defined(__GLIBC__)
+  if (TrimHeapThreshold && LastASTMemory > size_t(TrimHeapThreshold) << 20) {
+    malloc_trim(0);
+    ++Stats.HeapTrims;
   }
+#endif
+  LastASTMemory = 0;
 }
 
 struct DeclLoc {
@@ -37,97 +113,3515 @@ struct DeclLoc {
   unsigned Line;
 };
 
+static llvm::cl::opt<bool> DebugUSR(
+    "debug-usr",
+    llvm::cl::desc("Keep the USR of every symbol, print it with each finding "
+                   "and check it against the symbol hash"));
+
+/// Computes the SymbolHash of a declaration by writing its USR into a
+/// SymbolHashStream. This follows clang::index::USRGenerator, but the USR is
+/// never materialized as a string.
+class SymbolHasher {
+public:
+  explicit SymbolHasher(const ASTContext &Context)
+      : Context(Context), SM(Context.getSourceManager()) {
+    Out << "c:";
+  }
+
+  /// Returns false if no USR can be generated for \p D.
+  bool hash(const Decl *D, SymbolHash &Hash) {
+    // Declarations imported from another language (ExternalSourceSymbolAttr)
+    // get their defining module spliced into the USR; these are rare, so
+    // let clang generate them instead of mirroring that logic here.
+    if (D->getExternalSourceSymbolAttr()) {
+      SmallString<128> USR;
+      if (index::generateUSRForDecl(D, USR))
+        return false;
+      SymbolHashStream External;
+      External << USR;
+      Hash = External.result();
+      return true;
+    }
+    visit(D);
+    if (IgnoreResults)
+      return false;
+    Hash = Out.result();
+    return true;
+  }
+
+private:
+  static bool isLocal(const Decl *D) {
+    return D->getParentFunctionOrMethod() != nullptr;
+  }
+
+  bool shouldGenerateLocation(const NamedDecl *D) {
+    if (D->isExternallyVisible())
+      return false;
+    if (D->getParentFunctionOrMethod())
+      return true;
+    SourceLocation Loc = D->getLocation();
+    if (Loc.isInvalid())
+      return false;
+    return !SM.isInSystemHeader(Loc);
+  }
+
+  bool printLoc(SourceLocation Loc, bool IncludeOffset) {
+    if (Loc.isInvalid())
+      return true;
+    Loc = SM.getExpansionLoc(Loc);
+    std::pair<FileID, unsigned> Decomposed = SM.getDecomposedLoc(Loc);
+    StringRef Filename = SM.getFilename(Loc);
+    if (Filename.empty())
+      return true;
+    Out << llvm::sys::path::filename(Filename);
+    if (IncludeOffset)
+      Out << '@' << Decomposed.second;
+    return false;
+  }
+
+  bool genLoc(const Decl *D, bool IncludeOffset) {
+    if (GeneratedLoc)
+      return IgnoreResults;
+    GeneratedLoc = true;
+    D = D->getCanonicalDecl();
+    IgnoreResults = IgnoreResults || printLoc(D->getBeginLoc(), IncludeOffset);
+    return IgnoreResults;
+  }
+
+  bool emitDeclName(const NamedDecl *D) {
+    DeclarationName N = D->getDeclName();
+    if (N.isEmpty())
+      return true;
+    Out << N;
+    return false;
+  }
+
+  void visit(const Decl *D) {
+    if (IgnoreResults)
+      return;
+    if (const auto *FD = dyn_cast<FunctionDecl>(D))
+      visitFunctionDecl(FD);
+    else if (const auto *VD = dyn_cast<VarDecl>(D))
+      visitVarDecl(VD);
+    else if (const auto *FD = dyn_cast<FieldDecl>(D))
+      visitFieldDecl(FD);
+    else if (const auto *TD = dyn_cast<TagDecl>(D))
+      visitTagDecl(TD);
+    else if (const auto *ND = dyn_cast<NamespaceDecl>(D))
+      visitNamespaceDecl(ND);
+    else if (const auto *NAD = dyn_cast<NamespaceAliasDecl>(D)) {
+      visitDeclContext(NAD->getDeclContext());
+      Out << "@NA@" << NAD->getName();
+    } else if (const auto *FTD = dyn_cast<FunctionTemplateDecl>(D))
+      visitFunctionDecl(FTD->getTemplatedDecl());
+    else if (const auto *CTD = dyn_cast<ClassTemplateDecl>(D))
+      visitTagDecl(CTD->getTemplatedDecl());
+    else if (const auto *TND = dyn_cast<TypedefNameDecl>(D))
+      visitTypedefNameDecl(TND);
+    else if (isa<TemplateTypeParmDecl>(D) || isa<NonTypeTemplateParmDecl>(D) ||
+             isa<TemplateTemplateParmDecl>(D))
+      genLoc(D, /*IncludeOffset=*/true);
+    else if (isa<LinkageSpecDecl>(D))
+      IgnoreResults = true;
+    else if (const auto *ND = dyn_cast<NamedDecl>(D))
+      visitNamedDecl(ND);
+  }
+
+  void visitDeclContext(const DeclContext *DC) {
+    if (const auto *D = dyn_cast<NamedDecl>(DC))
+      visit(D);
+    else if (isa<LinkageSpecDecl>(DC)) // Linkage specs are transparent.
+      visitDeclContext(DC->getParent());
+  }
+
+  void visitNamedDecl(const NamedDecl *D) {
+    visitDeclContext(D->getDeclContext());
+    Out << "@";
+    if (emitDeclName(D))
+      IgnoreResults = true;
+  }
+
+  void visitNamespaceDecl(const NamespaceDecl *D) {
+    visitDeclContext(D->getDeclContext());
+    if (IgnoreResults)
+      return;
+    if (D->isAnonymousNamespace()) {
+      Out << "@aN";
+      return;
+    }
+    Out << "@N@" << D->getName();
+  }
+
+  void visitFieldDecl(const FieldDecl *D) {
+    visitDeclContext(D->getDeclContext());
+    Out << "@FI@";
+    if (emitDeclName(D))
+      IgnoreResults = true;
+  }
+
+  void visitTypedefNameDecl(const TypedefNameDecl *D) {
+    if (shouldGenerateLocation(D) && genLoc(D, isLocal(D)))
+      return;
+    if (const auto *DCN = dyn_cast<NamedDecl>(D->getDeclContext()))
+      visit(DCN);
+    Out << "@T@" << D->getName();
+  }
+
+  void visitFunctionDecl(const FunctionDecl *D) {
+    if (shouldGenerateLocation(D) && genLoc(D, isLocal(D)))
+      return;
+    if (D->getType().isNull()) {
+      IgnoreResults = true;
+      return;
+    }
+    visitDeclContext(D->getDeclContext());
+
+    bool IsTemplate = false;
+    if (FunctionTemplateDecl *FunTmpl = D->getDescribedFunctionTemplate()) {
+      IsTemplate = true;
+      Out << "@FT@";
+      visitTemplateParameterList(FunTmpl->getTemplateParameters());
+    } else {
+      Out << "@F@";
+    }
+
+    // Like clang, suppress the template arguments of constructors, as
+    // forward references can name them differently.
+    PrintingPolicy Policy(Context.getLangOpts());
+    Policy.SuppressTemplateArgsInCXXConstructorNames = true;
+    D->getDeclName().print(Out, Policy);
+
+    if ((!Context.getLangOpts().CPlusPlus || D->isExternC()) &&
+        !D->hasAttr<OverloadableAttr>())
+      return;
+
+    if (const TemplateArgumentList *SpecArgs =
+            D->getTemplateSpecializationArgs()) {
+      Out << '<';
+      for (unsigned I = 0, N = SpecArgs->size(); I != N; ++I) {
+        Out << '#';
+        visitTemplateArgument(SpecArgs->get(I));
+      }
+      Out << '>';
+    }
+
+    for (const ParmVarDecl *PD : D->parameters()) {
+      Out << '#';
+      visitType(PD->getType());
+    }
+    if (D->isVariadic())
+      Out << '.';
+    if (IsTemplate) {
+      // Function templates can be overloaded by return type.
+      Out << '#';
+      visitType(D->getReturnType());
+    }
+    Out << '#';
+    if (const auto *MD = dyn_cast<CXXMethodDecl>(D)) {
+      if (MD->isStatic())
+        Out << 'S';
+      if (unsigned Quals = MD->getMethodQualifiers().getCVRUQualifiers())
+        Out << char('0' + Quals);
+      switch (MD->getRefQualifier()) {
+      case RQ_None:
+        break;
+      case RQ_LValue:
+        Out << '&';
+        break;
+      case RQ_RValue:
+        Out << "&&";
+        break;
+      }
+    }
+  }
+
+  void visitVarDecl(const VarDecl *D) {
+    if (shouldGenerateLocation(D) && genLoc(D, isLocal(D)))
+      return;
+    visitDeclContext(D->getDeclContext());
+
+    if (VarTemplateDecl *VarTmpl = D->getDescribedVarTemplate()) {
+      Out << "@VT";
+      visitTemplateParameterList(VarTmpl->getTemplateParameters());
+    } else if (const auto *PartialSpec =
+                   dyn_cast<VarTemplatePartialSpecializationDecl>(D)) {
+      Out << "@VP";
+      visitTemplateParameterList(PartialSpec->getTemplateParameters());
+    }
+
+    StringRef Name = D->getName();
+    if (Name.empty()) {
+      IgnoreResults = true;
+      return;
+    }
+    Out << '@' << Name;
+
+    if (const auto *Spec = dyn_cast<VarTemplateSpecializationDecl>(D)) {
+      const TemplateArgumentList &Args = Spec->getTemplateArgs();
+      Out << '>';
+      for (unsigned I = 0, N = Args.size(); I != N; ++I) {
+        Out << '#';
+        visitTemplateArgument(Args.get(I));
+      }
+    }
+  }
+
+  void visitTagDecl(const TagDecl *D) {
+    // Add the location of the tag decl to handle resolution across
+    // translation units.
+    if (!isa<EnumDecl>(D) && shouldGenerateLocation(D) &&
+        genLoc(D, isLocal(D)))
+      return;
+
+    D = D->getCanonicalDecl();
+    visitDeclContext(D->getDeclContext());
+
+    bool AlreadyStarted = false;
+    if (const auto *CXXRecord = dyn_cast<CXXRecordDecl>(D)) {
+      if (ClassTemplateDecl *ClassTmpl = CXXRecord->getDescribedClassTemplate()) {
+        AlreadyStarted = true;
+        Out << (D->isUnion() ? "@UT" : "@ST");
+        visitTemplateParameterList(ClassTmpl->getTemplateParameters());
+      } else if (const auto *PartialSpec =
+                     dyn_cast<ClassTemplatePartialSpecializationDecl>(
+                         CXXRecord)) {
+        AlreadyStarted = true;
+        Out << (D->isUnion() ? "@UP" : "@SP");
+        visitTemplateParameterList(PartialSpec->getTemplateParameters());
+      }
+    }
+    if (!AlreadyStarted)
+      Out << (D->isUnion() ? "@U" : isa<EnumDecl>(D) ? "@E" : "@S");
+
+    // USRGenerator writes '@' and patches it afterwards for unnamed tags;
+    // decide up front which character to write instead.
+    if (!D->getDeclName().isEmpty()) {
+      Out << '@' << D->getDeclName();
+    } else if (const TypedefNameDecl *TD = D->getTypedefNameForAnonDecl()) {
+      Out << "A@" << *TD;
+    } else if (D->isEmbeddedInDeclarator() && !D->isFreeStanding()) {
+      Out << '@';
+      printLoc(D->getLocation(), /*IncludeOffset=*/true);
+    } else {
+      Out << 'a';
+      if (const auto *ED = dyn_cast<EnumDecl>(D)) {
+        // Distinguish anonymous enums by their first enumerator.
+        auto Enumerators = ED->enumerators();
+        if (Enumerators.begin() != Enumerators.end())
+          Out << '@' << **Enumerators.begin();
+      }
+    }
+
+    // For a class template specialization, mangle the template arguments.
+    if (const auto *Spec = dyn_cast<ClassTemplateSpecializationDecl>(D)) {
+      const TemplateArgumentList &Args = Spec->getTemplateArgs();
+      Out << '>';
+      for (unsigned I = 0, N = Args.size(); I != N; ++I) {
+        Out << '#';
+        visitTemplateArgument(Args.get(I));
+      }
+    }
+  }
+
+  void visitTemplateParameterList(const TemplateParameterList *Params) {
+    if (!Params)
+      return;
+    Out << '>' << Params->size();
+    for (const NamedDecl *P : *Params) {
+      Out << '#';
+      if (const auto *TTP = dyn_cast<TemplateTypeParmDecl>(P)) {
+        if (TTP->isParameterPack())
+          Out << 'p';
+        Out << 'T';
+        continue;
+      }
+      if (const auto *NTTP = dyn_cast<NonTypeTemplateParmDecl>(P)) {
+        if (NTTP->isParameterPack())
+          Out << 'p';
+        Out << 'N';
+        visitType(NTTP->getType());
+        continue;
+      }
+      const auto *TTP = cast<TemplateTemplateParmDecl>(P);
+      if (TTP->isParameterPack())
+        Out << 'p';
+      Out << 't';
+      visitTemplateParameterList(TTP->getTemplateParameters());
+    }
+  }
+
+  void visitTemplateName(TemplateName Name) {
+    if (TemplateDecl *Template = Name.getAsTemplateDecl()) {
+      if (const auto *TTP = dyn_cast<TemplateTemplateParmDecl>(Template)) {
+        Out << 't' << TTP->getDepth() << '.' << TTP->getIndex();
+        return;
+      }
+      visit(Template);
+    }
+  }
+
+  /// Prints a nested name specifier with the policy of clang's USRs.
+  void printQualifier(const NestedNameSpecifier *NNS) {
+    PrintingPolicy Policy(Context.getLangOpts());
+    Policy.SuppressTagKeyword = true;
+    Policy.SuppressUnwrittenScope = true;
+    Policy.ConstantArraySizeAsWritten = false;
+    Policy.AnonymousTagLocations = false;
+    NNS->print(Out, Policy);
+  }
+
+  void visitTemplateArgument(const TemplateArgument &Arg) {
+    switch (Arg.getKind()) {
+    case TemplateArgument::Declaration:
+      visit(Arg.getAsDecl());
+      break;
+    case TemplateArgument::TemplateExpansion:
+      Out << 'P'; // pack expansion of template template param
+      visitTemplateName(Arg.getAsTemplateOrTemplatePattern());
+      break;
+    case TemplateArgument::Template:
+      visitTemplateName(Arg.getAsTemplateOrTemplatePattern());
+      break;
+    case TemplateArgument::Pack:
+      Out << 'p' << Arg.pack_size();
+      for (const TemplateArgument &P : Arg.pack_elements())
+        visitTemplateArgument(P);
+      break;
+    case TemplateArgument::Type:
+      visitType(Arg.getAsType());
+      break;
+    case TemplateArgument::Integral:
+      Out << 'V';
+      visitType(Arg.getIntegralType());
+      Out << Arg.getAsIntegral();
+      break;
+#if CLANG_VERSION_MAJOR >= 18
+    case TemplateArgument::StructuralValue:
+      Out << 'S';
+      visitType(Arg.getStructuralValueType());
+      {
+        ODRHash Hash;
+        Hash.AddStructuralValue(Arg.getAsStructuralValue());
+        Out << Hash.CalculateHash();
+      }
+      break;
+#endif
+    case TemplateArgument::Null:
+    case TemplateArgument::NullPtr:
+    case TemplateArgument::Expression:
+      // USRGenerator emits nothing for these either.
+      break;
+    }
+  }
+
+  static char getBuiltinTypeChar(BuiltinType::Kind K) {
+    switch (K) {
+    case BuiltinType::Void:
+      return 'v';
+    case BuiltinType::Bool:
+      return 'b';
+    case BuiltinType::UChar:
+      return 'c';
+    case BuiltinType::Char8:
+      return 'u';
+    case BuiltinType::Char16:
+      return 'q';
+    case BuiltinType::Char32:
+      return 'w';
+    case BuiltinType::UShort:
+      return 's';
+    case BuiltinType::UInt:
+      return 'i';
+    case BuiltinType::ULong:
+      return 'l';
+    case BuiltinType::ULongLong:
+      return 'k';
+    case BuiltinType::UInt128:
+      return 'j';
+    case BuiltinType::Char_U:
+    case BuiltinType::Char_S:
+      return 'C';
+    case BuiltinType::SChar:
+      return 'r';
+    case BuiltinType::WChar_S:
+    case BuiltinType::WChar_U:
+      return 'W';
+    case BuiltinType::Short:
+      return 'S';
+    case BuiltinType::Int:
+      return 'I';
+    case BuiltinType::Long:
+      return 'L';
+    case BuiltinType::LongLong:
+      return 'K';
+    case BuiltinType::Int128:
+      return 'J';
+    case BuiltinType::Float16:
+    case BuiltinType::Half:
+      return 'h';
+    case BuiltinType::Float:
+      return 'f';
+    case BuiltinType::Double:
+      return 'd';
+#if CLANG_VERSION_MAJOR >= 14
+    case BuiltinType::Ibm128:
+      return '%';
+#endif
+    case BuiltinType::LongDouble:
+      return 'D';
+    case BuiltinType::Float128:
+      return 'Q';
+    case BuiltinType::NullPtr:
+      return 'n';
+    default:
+      return 0;
+    }
+  }
+
+  void visitType(QualType T) {
+    do {
+      T = Context.getCanonicalType(T);
+      Qualifiers Q = T.getQualifiers();
+      unsigned QVal = 0;
+      if (Q.hasConst())
+        QVal |= 0x1;
+      if (Q.hasVolatile())
+        QVal |= 0x2;
+      if (Q.hasRestrict())
+        QVal |= 0x4;
+      if (QVal)
+        Out << char('0' + QVal);
+
+      if (const auto *Expansion = T->getAs<PackExpansionType>()) {
+        Out << 'P';
+        T = Expansion->getPattern();
+      }
+
+      if (const auto *BT = T->getAs<BuiltinType>()) {
+        char C = getBuiltinTypeChar(BT->getKind());
+        if (!C) {
+          IgnoreResults = true;
+          return;
+        }
+        Out << C;
+        return;
+      }
+
+      // If we have already seen this (non-built-in) type, use a
+      // substitution encoding.
+      auto Inserted = TypeSubstitutions.try_emplace(T.getTypePtr(),
+                                                    TypeSubstitutions.size());
+      if (!Inserted.second) {
+        Out << 'S' << Inserted.first->second << '_';
+        return;
+      }
+
+      if (const auto *PT = T->getAs<PointerType>()) {
+        Out << '*';
+        T = PT->getPointeeType();
+        continue;
+      }
+      if (const auto *RT = T->getAs<RValueReferenceType>()) {
+        Out << "&&";
+        T = RT->getPointeeType();
+        continue;
+      }
+      if (const auto *RT = T->getAs<ReferenceType>()) {
+        Out << '&';
+        T = RT->getPointeeType();
+        continue;
+      }
+      if (const auto *FT = T->getAs<FunctionProtoType>()) {
+        Out << 'F';
+        visitType(FT->getReturnType());
+        Out << '(';
+        for (QualType P : FT->param_types()) {
+          Out << '#';
+          visitType(P);
+        }
+        Out << ')';
+        if (FT->isVariadic())
+          Out << '.';
+        return;
+      }
+      if (const auto *BT = T->getAs<BlockPointerType>()) {
+        Out << 'B';
+        T = BT->getPointeeType();
+        continue;
+      }
+      if (const auto *CT = T->getAs<ComplexType>()) {
+        Out << '<';
+        T = CT->getElementType();
+        continue;
+      }
+      if (const auto *TT = T->getAs<TagType>()) {
+        Out << '$';
+        visitTagDecl(TT->getDecl());
+        return;
+      }
+      if (const auto *TTP = T->getAs<TemplateTypeParmType>()) {
+        Out << 't' << TTP->getDepth() << '.' << TTP->getIndex();
+        return;
+      }
+      if (const auto *Spec = T->getAs<TemplateSpecializationType>()) {
+        Out << '>';
+        visitTemplateName(Spec->getTemplateName());
+        Out << Spec->template_arguments().size();
+        for (const TemplateArgument &Arg : Spec->template_arguments())
+          visitTemplateArgument(Arg);
+        return;
+      }
+      if (const auto *DNT = T->getAs<DependentNameType>()) {
+        Out << '^';
+        printQualifier(DNT->getQualifier());
+        Out << ':' << DNT->getIdentifier()->getName();
+        return;
+      }
+      if (const auto *InjT = T->getAs<InjectedClassNameType>()) {
+        T = InjT->getInjectedSpecializationType();
+        continue;
+      }
+      if (const auto *VT = T->getAs<VectorType>()) {
+        Out << (T->isExtVectorType() ? ']' : '[');
+        Out << VT->getNumElements();
+        T = VT->getElementType();
+        continue;
+      }
+      if (const auto *AT = dyn_cast<ArrayType>(T)) {
+        Out << '{';
+        switch (AT->getSizeModifier()) {
+#if CLANG_VERSION_MAJOR >= 18
+        case ArraySizeModifier::Static:
+          Out << 's';
+          break;
+        case ArraySizeModifier::Star:
+          Out << '*';
+          break;
+        case ArraySizeModifier::Normal:
+          Out << 'n';
+          break;
+#else
+        case ArrayType::Static:
+          Out << 's';
+          break;
+        case ArrayType::Star:
+          Out << '*';
+          break;
+        case ArrayType::Normal:
+          Out << 'n';
+          break;
+#endif
+        }
+        if (const auto *CAT = dyn_cast<ConstantArrayType>(T))
+          Out << CAT->getSize();
+        T = AT->getElementType();
+        continue;
+      }
+
+      // Unhandled type.
+      Out << ' ';
+      break;
+    } while (true);
+  }
+
+  const ASTContext &Context;
+  const SourceManager &SM;
+  SymbolHashStream Out;
+  llvm::SmallDenseMap<const Type *, unsigned, 8> TypeSubstitutions;
+  bool GeneratedLoc = false;
+  bool IgnoreResults = false;
+};
+
+bool getSymbolHash(const Decl *D, SymbolHash &Hash) {
+  return SymbolHasher(D->getASTContext()).hash(D, Hash);
+}
+
+/// Hashes a USR that was generated by clang::index::generateUSRForDecl.
+/// Used to check that SymbolHasher agrees with clang.
+SymbolHash getSymbolHash(StringRef USR) {
+  SymbolHashStream Out;
+  Out << USR;
+  return Out.result();
+}
+
+enum class SymbolKind : uint8_t {
+  Function,
+  Variable,
+  Type,
+  Enumerator,
+  Macro
+};
+
+const char *getKindName(SymbolKind Kind) {
+  switch (Kind) {
+  case SymbolKind::Function:
+    return "Function";
+  case SymbolKind::Variable:
+    return "Variable";
+  case SymbolKind::Type:
+    return "Type";
+  case SymbolKind::Enumerator:
+    return "Enumerator";
+  case SymbolKind::Macro:
+    return "Macro";
+  }
+  llvm_unreachable("unknown symbol kind");
+}
+
+/// Tracks whether a set of ids, like the translation units that use a
+/// symbol, is empty, has exactly one element or more.
+struct UniqueId {
+  enum StateKind : uint8_t { None, One, Many };
+  StateKind State = None;
+  uint32_t Id = 0;
+
+  void add(uint32_t NewId) { add(UniqueId{One, NewId}); }
+  void add(const UniqueId &Other) {
+    if (Other.State == None)
+      return;
+    if (State == None)
+      *this = Other;
+    else if (Other.State == Many || Other.Id != Id)
+      State = Many;
+  }
+  bool isOnly(uint32_t OnlyId) const { return State == One && Id == OnlyId; }
+};
+
 struct DefInfo {
-  const FunctionDecl *Definition;
-  size_t Uses;
+  bool Defined = false;
+  SymbolKind Kind = SymbolKind::Function;
+  /// Set for variables whose initialization runs code at program startup.
+  bool DynamicInit = false;
+  /// Number of translation units that parsed the definition of a type or
+  /// macro without using it.
+  size_t IncludingTUs = 0;
+  size_t Uses = 0;
   std::string Name;
   std::string Filename;
-  unsigned Line;
+  unsigned Line = 0;
   std::vector<DeclLoc> Declarations;
+  /// Number of source lines of the definition of a type, macro or header
+  /// function (-header-waste).
+  unsigned Lines = 0;
+  /// Number of AST nodes in the body of a function (-sort-by-size).
+  unsigned Size = 0;
+  /// Functions called by the dynamic initializer (-static-initializers).
+  std::vector<std::string> InitCallees;
+  /// Set for definitions with external linkage that could be static.
+  bool CanBeInternal = false;
+  /// Set for definitions with default visibility that could be hidden.
+  bool CanBeHidden = false;
+  /// The translation unit and library of the definition.
+  uint32_t DefTU = 0;
+  uint32_t DefLibrary = 0;
+  /// The translation units and libraries that use the symbol.
+  UniqueId UserTUs;
+  UniqueId UserLibraries;
+  /// The category of the definition and the mask of the categories that
+  /// use the symbol (-category-map).
+  uint32_t DefCategory = 0;
+  uint32_t UserCategories = 0;
+  /// The component of the definition's file and the mask of the components
+  /// whose TUs use the symbol (-component-map).
+  uint32_t DefComponent = 0;
+  uint64_t UserComponents = 0;
+  /// Number of distinct references in main files (-call-sites). References
+  /// in headers are seen by every TU that includes them, so they can't be
+  /// counted exactly and only set HeaderReferences.
+  size_t References = 0;
+  bool HeaderReferences = false;
+  /// The function containing the reference, if there is exactly one.
+  std::string Caller;
+  /// Set for polymorphic classes and virtual methods that are not final
+  /// (-could-be-final), and for those that are derived from or overridden.
+  bool CanBeFinal = false;
+  bool Overridden = false;
+  /// Set for inline and template functions defined in headers
+  /// (-header-functions).
+  bool HeaderFunction = false;
+  /// Set for symbols that a shared library exports (-exported-symbols).
+  bool Exported = false;
+  /// Set for functions that the -profile has a record for, but that never
+  /// ran.
+  bool NeverExecuted = false;
+  /// The mangled name of a function or variable definition (-scan).
+  std::string SymbolName;
+
+  /// Combines the information that another translation unit recorded for
+  /// the same symbol.
+  void merge(DefInfo &&Other) {
+    if (Other.Defined && !Defined) {
+      Defined = true;
+      Kind = Other.Kind;
+      DynamicInit = Other.DynamicInit;
+      Name = std::move(Other.Name);
+      Filename = std::move(Other.Filename);
+      Line = Other.Line;
+      Lines = Other.Lines;
+      Size = Other.Size;
+      Declarations = std::move(Other.Declarations);
+      InitCallees = std::move(Other.InitCallees);
+      CanBeInternal = Other.CanBeInternal;
+      CanBeHidden = Other.CanBeHidden;
+      DefTU = Other.DefTU;
+      DefLibrary = Other.DefLibrary;
+      DefCategory = Other.DefCategory;
+      DefComponent = Other.DefComponent;
+      NeverExecuted = Other.NeverExecuted;
+      SymbolName = std::move(Other.SymbolName);
+    } else if (!Defined && Name.empty() && !Other.Name.empty()) {
+      // Class hierarchy records name symbols that may not be defined.
+      Kind = Other.Kind;
+      Name = std::move(Other.Name);
+      Filename = std::move(Other.Filename);
+      Line = Other.Line;
+      Lines = Other.Lines;
+    }
+    Uses += Other.Uses;
+    UserTUs.add(Other.UserTUs);
+    UserLibraries.add(Other.UserLibraries);
+    UserCategories |= Other.UserCategories;
+    UserComponents |= Other.UserComponents;
+    IncludingTUs += Other.IncludingTUs;
+    References += Other.References;
+    HeaderReferences |= Other.HeaderReferences;
+    if (Caller.empty())
+      Caller = std::move(Other.Caller);
+    CanBeFinal |= Other.CanBeFinal;
+    Overridden |= Other.Overridden;
+    HeaderFunction |= Other.HeaderFunction;
+    Exported |= Other.Exported;
+  }
+
+  /// Approximate number of heap bytes owned by this DefInfo.
+  size_t getMemorySize() const {
+    size_t Size = Name.capacity() + Filename.capacity() + Caller.capacity() +
+                  SymbolName.capacity() +
+                  Declarations.capacity() * sizeof(DeclLoc) +
+                  InitCallees.capacity() * sizeof(std::string);
+    for (const std::string &Callee : InitCallees)
+      Size += Callee.capacity();
+    return Size;
+  }
 };
 
-std::mutex Mutex;
-std::map<std::string, DefInfo> AllDecls;
+/// Binary encoding of spilled symbol table runs. Runs are only read back by
+/// the process that wrote them, so fixed-size fields use native byte order.
+class RecordWriter {
+public:
+  explicit RecordWriter(llvm::raw_ostream &OS) : OS(OS) {}
 
-bool getUSRForDecl(const Decl *Decl, std::string &USR) {
-  llvm::SmallVector<char, 128> Buff;
+  void writeFixed(uint64_t V) {
+    OS.write(reinterpret_cast<const char *>(&V), sizeof(V));
+  }
+  void writeInt(uint64_t V) { llvm::encodeULEB128(V, OS); }
+  void writeString(StringRef S) {
+    writeInt(S.size());
+    OS << S;
+  }
 
-  if (index::generateUSRForDecl(Decl, Buff))
-    return false;
+  void write(const UniqueId &U) {
+    writeInt(U.State);
+    writeInt(U.Id);
+  }
 
-  USR = std::string(Buff.data(), Buff.size());
-  return true;
+  void write(const SymbolHash &Hash, const DefInfo &I) {
+    writeFixed(Hash.High);
+    writeFixed(Hash.Low);
+    writeInt(I.Defined);
+    writeInt(static_cast<uint64_t>(I.Kind));
+    writeInt(I.DynamicInit);
+    writeInt(I.IncludingTUs);
+    writeInt(I.CanBeInternal);
+    writeInt(I.CanBeHidden);
+    writeInt(I.DefTU);
+    writeInt(I.DefLibrary);
+    write(I.UserTUs);
+    write(I.UserLibraries);
+    writeInt(I.DefCategory);
+    writeInt(I.UserCategories);
+    writeInt(I.DefComponent);
+    writeInt(I.UserComponents);
+    writeInt(I.References);
+    writeInt(I.HeaderReferences);
+    writeString(I.Caller);
+    writeInt(I.CanBeFinal);
+    writeInt(I.Overridden);
+    writeInt(I.HeaderFunction);
+    writeInt(I.Exported);
+    writeInt(I.NeverExecuted);
+    writeString(I.SymbolName);
+    writeInt(I.Uses);
+    writeString(I.Name);
+    writeString(I.Filename);
+    writeInt(I.Line);
+    writeInt(I.Lines);
+    writeInt(I.Size);
+    writeInt(I.Declarations.size());
+    for (const DeclLoc &D : I.Declarations) {
+      writeString(D.Filename);
+      writeInt(D.Line);
+    }
+    writeInt(I.InitCallees.size());
+    for (const std::string &Callee : I.InitCallees)
+      writeString(Callee);
+  }
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+class RecordReader {
+public:
+  explicit RecordReader(StringRef Data)
+      : Cur(reinterpret_cast<const uint8_t *>(Data.begin())),
+        End(reinterpret_cast<const uint8_t *>(Data.end())) {}
+
+  bool atEnd() const { return Cur == End; }
+
+  bool readFixed(uint64_t &V) {
+    if (size_t(End - Cur) < sizeof(V))
+      return false;
+    memcpy(&V, Cur, sizeof(V));
+    Cur += sizeof(V);
+    return true;
+  }
+  bool readInt(uint64_t &V) {
+    unsigned N;
+    const char *Error = nullptr;
+    V = llvm::decodeULEB128(Cur, &N, End, &Error);
+    Cur += N;
+    return !Error;
+  }
+  template <class T> bool readInt(T &V) {
+    uint64_t Tmp;
+    if (!readInt(Tmp))
+      return false;
+    V = static_cast<T>(Tmp);
+    return true;
+  }
+  template <class StringT> bool readString(StringT &S) {
+    uint64_t Size;
+    if (!readInt(Size) || size_t(End - Cur) < Size)
+      return false;
+    S.assign(reinterpret_cast<const char *>(Cur),
+             reinterpret_cast<const char *>(Cur) + Size);
+    Cur += Size;
+    return true;
+  }
+
+  bool readBytes(size_t Size, StringRef &Bytes) {
+    if (size_t(End - Cur) < Size)
+      return false;
+    Bytes = StringRef(reinterpret_cast<const char *>(Cur), Size);
+    Cur += Size;
+    return true;
+  }
+
+  bool readHash(SymbolHash &Hash) {
+    return readFixed(Hash.High) && readFixed(Hash.Low);
+  }
+  bool read(UniqueId &U) { return readInt(U.State) && readInt(U.Id); }
+
+  bool read(DefInfo &I) {
+    uint64_t NumDecls, NumCallees;
+    if (!readInt(I.Defined) || !readInt(I.Kind) || !readInt(I.DynamicInit) ||
+        !readInt(I.IncludingTUs) || !readInt(I.CanBeInternal) ||
+        !readInt(I.CanBeHidden) || !readInt(I.DefTU) ||
+        !readInt(I.DefLibrary) || !read(I.UserTUs) ||
+        !read(I.UserLibraries) || !readInt(I.DefCategory) ||
+        !readInt(I.UserCategories) || !readInt(I.DefComponent) ||
+        !readInt(I.UserComponents) ||
+        !readInt(I.References) ||
+        !readInt(I.HeaderReferences) || !readString(I.Caller) ||
+        !readInt(I.CanBeFinal) || !readInt(I.Overridden) ||
+        !readInt(I.HeaderFunction) || !readInt(I.Exported) ||
+        !readInt(I.NeverExecuted) || !readString(I.SymbolName) ||
+        !readInt(I.Uses) || !readString(I.Name) ||
+        !readString(I.Filename) || !readInt(I.Line) || !readInt(I.Lines) ||
+        !readInt(I.Size) || !readInt(NumDecls))
+      return false;
+    I.Declarations.resize(NumDecls);
+    for (DeclLoc &D : I.Declarations)
+      if (!readString(D.Filename) || !readInt(D.Line))
+        return false;
+    if (!readInt(NumCallees))
+      return false;
+    I.InitCallees.resize(NumCallees);
+    for (std::string &Callee : I.InitCallees)
+      if (!readString(Callee))
+        return false;
+    return true;
+  }
+
+private:
+  const uint8_t *Cur;
+  const uint8_t *End;
+};
+
+static llvm::cl::opt<unsigned> AggregationMemoryLimit(
+    "aggregation-memory-limit",
+    llvm::cl::desc("Spill the merged symbol table to temporary files when it "
+                   "grows beyond this many MiB (0 keeps it in memory)"),
+    llvm::cl::init(0));
+
+/// The symbol table merged over all translation units. Once it grows beyond
+/// -aggregation-memory-limit, it is written to a temporary file as a run
+/// sorted by symbol hash and cleared. forEachSymbol() then does a k-way merge
+/// over all runs, so peak memory stays bounded by the limit.
+class SymbolTable {
+public:
+  ~SymbolTable() {
+    for (const std::string &Run : Runs)
+      llvm::sys::fs::remove(Run);
+  }
+
+  void add(const SymbolHash &Hash, DefInfo &&I) {
+    auto It = Symbols.try_emplace(Hash);
+    HeapSize -= It.first->second.getMemorySize();
+    It.first->second.merge(std::move(I));
+    HeapSize += It.first->second.getMemorySize();
+
+    if (AggregationMemoryLimit &&
+        Symbols.getMemorySize() + HeapSize >
+            uint64_t(AggregationMemoryLimit) << 20) {
+      if (auto Err = spill()) {
+        llvm::errs() << "warning: " << llvm::toString(std::move(Err))
+                     << "; keeping the symbol table in memory\n";
+        AggregationMemoryLimit = 0;
+      }
+    }
+  }
+
+  /// Calls \p Fn once per symbol with the information merged over all
+  /// translation units, in no particular order.
+  llvm::Error
+  forEachSymbol(llvm::function_ref<void(const SymbolHash &, DefInfo &)> Fn) {
+    if (Runs.empty()) {
+      for (auto &KV : Symbols)
+        Fn(KV.first, KV.second);
+      return llvm::Error::success();
+    }
+    if (auto Err = spill())
+      return Err;
+    return mergeRuns(Fn);
+  }
+
+private:
+  llvm::Error spill() {
+    std::vector<std::pair<SymbolHash, DefInfo> *> Sorted;
+    Sorted.reserve(Symbols.size());
+    for (auto &KV : Symbols)
+      Sorted.push_back(&KV);
+    std::sort(Sorted.begin(), Sorted.end(),
+              [](const std::pair<SymbolHash, DefInfo> *A,
+                 const std::pair<SymbolHash, DefInfo> *B) {
+                return A->first < B->first;
+              });
+
+    int FD;
+    SmallString<128> Path;
+    if (std::error_code EC =
+            llvm::sys::fs::createTemporaryFile("xunused", "run", FD, Path))
+      return llvm::createStringError(EC, "cannot create temporary file");
+    llvm::sys::RemoveFileOnSignal(Path);
+    Runs.push_back(std::string(Path));
+
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    RecordWriter W(OS);
+    for (const auto *KV : Sorted)
+      W.write(KV->first, KV->second);
+    OS.close();
+    if (OS.has_error()) {
+      std::error_code EC = OS.error();
+      OS.clear_error();
+      return llvm::createStringError(EC, "cannot write '%s'", Path.c_str());
+    }
+
+    // Release the buckets too; shrink_and_clear() would keep enough of them
+    // to exceed the limit again right away.
+    Symbols = llvm::DenseMap<SymbolHash, DefInfo>();
+    HeapSize = 0;
+    return llvm::Error::success();
+  }
+
+  struct RunCursor {
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    RecordReader Reader;
+    SymbolHash Hash;
+  };
+
+  llvm::Error
+  mergeRuns(llvm::function_ref<void(const SymbolHash &, DefInfo &)> Fn) {
+    std::vector<RunCursor> Cursors;
+    for (const std::string &Run : Runs) {
+      auto Buffer = llvm::MemoryBuffer::getFile(Run);
+      if (!Buffer)
+        return llvm::createStringError(Buffer.getError(), "cannot read '%s'",
+                                       Run.c_str());
+      RecordReader Reader((*Buffer)->getBuffer());
+      Cursors.push_back({std::move(*Buffer), Reader, SymbolHash()});
+    }
+
+    // Min-heap of the cursors by the hash of their next record.
+    auto Greater = [&](unsigned A, unsigned B) {
+      return Cursors[B].Hash < Cursors[A].Hash;
+    };
+    std::vector<unsigned> Heap;
+    for (unsigned I = 0; I != Cursors.size(); ++I) {
+      if (Cursors[I].Reader.atEnd())
+        continue;
+      if (!Cursors[I].Reader.readHash(Cursors[I].Hash))
+        return llvm::createStringError(std::errc::illegal_byte_sequence,
+                                       "corrupt run '%s'", Runs[I].c_str());
+      Heap.push_back(I);
+    }
+    std::make_heap(Heap.begin(), Heap.end(), Greater);
+
+    while (!Heap.empty()) {
+      SymbolHash Hash = Cursors[Heap.front()].Hash;
+      DefInfo Merged;
+      while (!Heap.empty() && Cursors[Heap.front()].Hash == Hash) {
+        std::pop_heap(Heap.begin(), Heap.end(), Greater);
+        unsigned I = Heap.back();
+        DefInfo Info;
+        if (!Cursors[I].Reader.read(Info))
+          return llvm::createStringError(std::errc::illegal_byte_sequence,
+                                         "corrupt run '%s'", Runs[I].c_str());
+        Merged.merge(std::move(Info));
+        if (Cursors[I].Reader.atEnd()) {
+          Heap.pop_back();
+          continue;
+        }
+        if (!Cursors[I].Reader.readHash(Cursors[I].Hash))
+          return llvm::createStringError(std::errc::illegal_byte_sequence,
+                                         "corrupt run '%s'", Runs[I].c_str());
+        std::push_heap(Heap.begin(), Heap.end(), Greater);
+      }
+      Fn(Hash, Merged);
+    }
+    return llvm::Error::success();
+  }
+
+  llvm::DenseMap<SymbolHash, DefInfo> Symbols;
+  size_t HeapSize = 0; // Heap bytes owned by the DefInfos in Symbols.
+  std::vector<std::string> Runs;
+};
+
+static llvm::cl::opt<bool> Reachability(
+    "reachability",
+    llvm::cl::desc("Report functions that are not reachable from main, "
+                   "exported functions, constructors, used functions and "
+                   "-root functions, instead of those without uses"));
+
+static llvm::cl::list<std::string> Roots(
+    "root",
+    llvm::cl::desc("Regular expression for the qualified names of additional "
+                   "root functions with -reachability"));
+
+/// Caller to callee edges between symbols, collected from all TUs. Nodes are
+/// numbered densely so that each edge takes 8 bytes.
+class CallGraph {
+public:
+  /// Virtual node that calls all roots.
+  static constexpr uint32_t Root = 0;
+
+  uint32_t getNode(const SymbolHash &Hash) {
+    auto Ins = Ids.try_emplace(Hash, NumNodes);
+    if (Ins.second)
+      ++NumNodes;
+    return Ins.first->second;
+  }
+  bool lookup(const SymbolHash &Hash, uint32_t &Node) const {
+    auto It = Ids.find(Hash);
+    if (It == Ids.end())
+      return false;
+    Node = It->second;
+    return true;
+  }
+
+  void addEdge(uint32_t From, uint32_t To) {
+    // Functions defined in headers contribute the same edges in every TU.
+    if (Edges.size() == Edges.capacity() && Edges.size() >= 2 * UniqueEdges) {
+      sort_unique(Edges);
+      UniqueEdges = Edges.size();
+    }
+    Edges.emplace_back(From, To);
+  }
+
+  size_t getNumEdges() const { return Targets.size(); }
+
+  /// Marks every node that is reachable from Root. This converts the edge
+  /// list into compressed sparse rows first and frees it.
+  void computeReachable() {
+    Offsets.assign(NumNodes + 1, 0);
+    for (const auto &E : Edges)
+      ++Offsets[E.first + 1];
+    std::partial_sum(Offsets.begin(), Offsets.end(), Offsets.begin());
+    Targets.resize(Edges.size());
+    std::vector<uint32_t> Pos(Offsets.begin(), Offsets.end() - 1);
+    for (const auto &E : Edges)
+      Targets[Pos[E.first]++] = E.second;
+    std::vector<std::pair<uint32_t, uint32_t>>().swap(Edges);
+
+    Reachable.reset();
+    Reachable.resize(NumNodes);
+    Reachable.set(Root);
+    std::vector<uint32_t> Frontier{Root}, Next;
+    while (!Frontier.empty()) {
+      for (uint32_t U : Frontier)
+        for (uint32_t E = Offsets[U]; E != Offsets[U + 1]; ++E)
+          if (!Reachable.test(Targets[E])) {
+            Reachable.set(Targets[E]);
+            Next.push_back(Targets[E]);
+          }
+      Frontier.swap(Next);
+      Next.clear();
+    }
+  }
+
+  bool isReachable(uint32_t Node) const { return Reachable.test(Node); }
+
+  /// Returns for each node the size of its strongly connected component
+  /// among the unreachable nodes, or 0 for reachable nodes. Must be called
+  /// after computeReachable().
+  std::vector<uint32_t> getDeadComponentSizes() const {
+    const uint32_t Unvisited = ~0u;
+    std::vector<uint32_t> Index(NumNodes, Unvisited), Low(NumNodes);
+    std::vector<uint32_t> Sizes(NumNodes, 0);
+    llvm::BitVector OnStack(NumNodes);
+    std::vector<uint32_t> Stack;
+    std::vector<std::pair<uint32_t, uint32_t>> Work; // Node, next edge.
+    uint32_t Counter = 0;
+
+    auto Push = [&](uint32_t U) {
+      Index[U] = Low[U] = Counter++;
+      Stack.push_back(U);
+      OnStack.set(U);
+      Work.emplace_back(U, Offsets[U]);
+    };
+
+    // Iterative Tarjan, so that long call chains don't overflow the stack.
+    for (uint32_t Start = 0; Start != NumNodes; ++Start) {
+      if (Reachable.test(Start) || Index[Start] != Unvisited)
+        continue;
+      Push(Start);
+      while (!Work.empty()) {
+        uint32_t U = Work.back().first;
+        uint32_t &E = Work.back().second;
+        if (E != Offsets[U + 1]) {
+          uint32_t V = Targets[E++];
+          if (Reachable.test(V))
+            continue;
+          if (Index[V] == Unvisited)
+            Push(V);
+          else if (OnStack.test(V))
+            Low[U] = std::min(Low[U], Index[V]);
+          continue;
+        }
+        Work.pop_back();
+        if (!Work.empty()) {
+          uint32_t Parent = Work.back().first;
+          Low[Parent] = std::min(Low[Parent], Low[U]);
+        }
+        if (Low[U] != Index[U])
+          continue;
+        auto It = std::find(Stack.rbegin(), Stack.rend(), U).base() - 1;
+        uint32_t Size = Stack.end() - It;
+        for (auto C = It; C != Stack.end(); ++C) {
+          Sizes[*C] = Size;
+          OnStack.reset(*C);
+        }
+        Stack.erase(It, Stack.end());
+      }
+    }
+    return Sizes;
+  }
+
+private:
+  llvm::DenseMap<SymbolHash, uint32_t> Ids;
+  uint32_t NumNodes = 1; // Root
+  std::vector<std::pair<uint32_t, uint32_t>> Edges;
+  size_t UniqueEdges = 0;
+  std::vector<uint32_t> Offsets; // Compressed sparse rows
+  std::vector<uint32_t> Targets;
+  llvm::BitVector Reachable;
+};
+
+static llvm::cl::opt<bool> CouldBeStatic(
+    "could-be-static",
+    llvm::cl::desc("Also report functions with external linkage that are only "
+                   "used in the translation unit that defines them"));
+
+static llvm::cl::opt<bool> CouldBeHidden(
+    "could-be-hidden",
+    llvm::cl::desc("Also report functions with default visibility that are "
+                   "only used from their own library"));
+
+static llvm::cl::opt<std::string> LibraryMapFile(
+    "library-map",
+    llvm::cl::desc("File with lines '<library> <regex>' that assign "
+                   "translation units to libraries by their main file; "
+                   "without it, libraries are taken from the output paths "
+                   "of the compile commands"),
+    llvm::cl::value_desc("file"));
+
+/// Assigns translation units to libraries for -could-be-hidden, or to
+/// categories for -category-map, by patterns on their main file. Ids start
+/// at 1; 0 is a file that no pattern matches.
+class PathMap {
+public:
+  llvm::Error load(StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return llvm::createStringError(
+          Buffer.getError(), "cannot read '%s': %s",
+          Path.str().c_str(), Buffer.getError().message().c_str());
+    StringRef Rest = (*Buffer)->getBuffer();
+    while (!Rest.empty()) {
+      StringRef Line;
+      std::tie(Line, Rest) = Rest.split('\n');
+      Line = Line.trim();
+      if (Line.empty() || Line.front() == '#')
+        continue;
+      size_t Space = Line.find_first_of(" \t");
+      StringRef Name = Line.substr(0, Space);
+      StringRef Pattern = Line.substr(Space).trim();
+      if (Pattern.empty())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "missing pattern in line '%s' in '%s'",
+                                       Line.str().c_str(), Path.str().c_str());
+      llvm::Regex Regex(Pattern);
+      std::string Error;
+      if (!Regex.isValid(Error))
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "invalid pattern '%s' in '%s': %s",
+                                       Pattern.str().c_str(),
+                                       Path.str().c_str(), Error.c_str());
+      Patterns.emplace_back(std::move(Regex), getOrAddName(Name));
+    }
+    return llvm::Error::success();
+  }
+
+  /// Returns the id of a name, adding it if it is new.
+  uint32_t getOrAddName(StringRef Name) {
+    auto It = std::find(Names.begin(), Names.end(), Name);
+    if (It == Names.end())
+      It = Names.insert(It, Name.str());
+    return It - Names.begin() + 1;
+  }
+
+  /// Returns the id of a translation unit's main file; the first matching
+  /// pattern wins.
+  uint32_t getId(StringRef Filename) const {
+    for (const auto &P : Patterns)
+      if (P.first.match(Filename))
+        return P.second;
+    return 0;
+  }
+
+  StringRef getName(uint32_t Id) const { return Names[Id - 1]; }
+  size_t size() const { return Names.size(); }
+
+private:
+  std::vector<std::pair<llvm::Regex, uint32_t>> Patterns;
+  std::vector<std::string> Names;
+};
+
+PathMap Libraries;
+
+/// The library of each main file by the output path of its compile command,
+/// for -could-be-hidden without -library-map. Files that are compiled into
+/// several libraries map to 0.
+llvm::StringMap<uint32_t> OutputLibraries;
+
+/// Returns the library that an object file is built for: the target of
+/// CMake's "CMakeFiles/<target>.dir" directories, or else the directory of
+/// the object file.
+std::string getLibraryOfOutput(StringRef Output) {
+  for (auto It = llvm::sys::path::rbegin(Output),
+            End = llvm::sys::path::rend(Output);
+       It != End; ++It) {
+    auto Next = std::next(It);
+    if (It->endswith(".dir") && Next != End && *Next == "CMakeFiles")
+      return It->drop_back(4).str();
+  }
+  return llvm::sys::path::parent_path(Output).str();
+}
+
+/// Fills OutputLibraries from the output paths of the compile commands.
+/// Returns false if no command has an output path.
+bool loadOutputLibraries(const tooling::CompilationDatabase &Compilations) {
+  bool HasOutput = false;
+  for (const tooling::CompileCommand &Command :
+       Compilations.getAllCompileCommands()) {
+    if (Command.Output.empty())
+      continue;
+    HasOutput = true;
+    SmallString<256> File(Command.Filename), Output(Command.Output);
+    llvm::sys::fs::make_absolute(Command.Directory, File);
+    llvm::sys::fs::make_absolute(Command.Directory, Output);
+    llvm::sys::path::remove_dots(File, /*remove_dot_dot=*/true);
+    llvm::sys::path::remove_dots(Output, /*remove_dot_dot=*/true);
+    uint32_t Id = Libraries.getOrAddName(getLibraryOfOutput(Output));
+    auto Ins = OutputLibraries.try_emplace(File, Id);
+    if (!Ins.second && Ins.first->second != Id)
+      Ins.first->second = 0;
+  }
+  return HasOutput;
+}
+std::atomic<uint32_t> NextTUId{0};
+
+static llvm::cl::opt<std::string> CategoryMapFile(
+    "category-map",
+    llvm::cl::desc("File with lines '<category> <regex>' that assign "
+                   "translation units to categories like test or tool by "
+                   "their main file; also report symbols that are only used "
+                   "from other categories than their own"),
+    llvm::cl::value_desc("file"));
+
+/// Categories of translation units for -category-map. Uses are recorded as
+/// a bitmask of categories, bit 0 being the files without category.
+PathMap Categories;
+constexpr size_t MaxCategories = 31;
+
+/// Returns the names of the categories in a mask, like "test and tool".
+std::string getCategoryNames(uint32_t Mask) {
+  std::string Names;
+  for (uint32_t Id = 0; Id <= MaxCategories; ++Id) {
+    if (!(Mask & (1u << Id)))
+      continue;
+    Mask &= ~(1u << Id);
+    if (!Names.empty())
+      Names += Mask ? ", " : " and ";
+    Names += Id ? Categories.getName(Id).str() : "uncategorized files";
+  }
+  return Names;
+}
+
+static llvm::cl::opt<std::string> ComponentMapFile(
+    "component-map",
+    llvm::cl::desc("File that defines components by path prefixes; also "
+                   "report symbols of each component that are only used "
+                   "from outside of it"),
+    llvm::cl::value_desc("file"));
+
+/// Components for -component-map. The file has lines
+///   component <name> <path prefix>...
+///   internal <name> <component>...
+/// where uses from the components listed as internal count for <name> like
+/// its own uses. Path prefixes are matched by whole path components, the
+/// longest prefix wins, and relative prefixes are relative to the file.
+class ComponentMap {
+public:
+  static constexpr size_t MaxComponents = 64;
+
+  llvm::Error load(StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return llvm::createStringError(Buffer.getError(),
+                                     "cannot read '%s': %s",
+                                     Path.str().c_str(),
+                                     Buffer.getError().message().c_str());
+    SmallString<256> Dir(Path);
+    llvm::sys::fs::make_absolute(Dir);
+    llvm::sys::path::remove_filename(Dir);
+
+    StringRef Rest = (*Buffer)->getBuffer();
+    while (!Rest.empty()) {
+      StringRef Line;
+      std::tie(Line, Rest) = Rest.split('\n');
+      SmallVector<StringRef, 8> Fields;
+      llvm::SplitString(Line, Fields, " \t\r");
+      if (Fields.empty() || Fields[0].front() == '#')
+        continue;
+      if (Fields.size() < 3 ||
+          (Fields[0] != "component" && Fields[0] != "internal"))
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "invalid line '%s' in '%s'",
+                                       Line.trim().str().c_str(),
+                                       Path.str().c_str());
+      uint32_t Id = getOrAddComponent(Fields[1]);
+      if (Id > MaxComponents)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "more than %zu components in '%s'",
+                                       MaxComponents, Path.str().c_str());
+      for (StringRef Field : ArrayRef<StringRef>(Fields).drop_front(2)) {
+        if (Fields[0] == "internal") {
+          uint32_t Other = getOrAddComponent(Field);
+          if (Other > MaxComponents)
+            return llvm::createStringError(
+                llvm::inconvertibleErrorCode(),
+                "more than %zu components in '%s'", MaxComponents,
+                Path.str().c_str());
+          InternalMasks[Id - 1] |= getBit(Other);
+          continue;
+        }
+        SmallString<256> Prefix(Field);
+        llvm::sys::fs::make_absolute(Dir, Prefix);
+        llvm::sys::path::remove_dots(Prefix, /*remove_dot_dot=*/true);
+        addPrefix(Prefix, Id);
+        // Definitions are looked up by their real path.
+        SmallString<256> RealPrefix;
+        if (!llvm::sys::fs::real_path(Prefix, RealPrefix) &&
+            RealPrefix != Prefix)
+          addPrefix(RealPrefix, Id);
+      }
+    }
+    return llvm::Error::success();
+  }
+
+  /// Returns the component of a file, or 0. The path must be absolute, like
+  /// those of getNormalizedFilename, as translation units may have their
+  /// own working directories.
+  uint32_t getComponent(StringRef Filename) const {
+    uint32_t Node = 0, Component = 0;
+    for (StringRef C : llvm::make_range(llvm::sys::path::begin(Filename),
+                                        llvm::sys::path::end(Filename))) {
+      auto It = Nodes[Node].Children.find(C);
+      if (It == Nodes[Node].Children.end())
+        break;
+      Node = It->second;
+      if (Nodes[Node].Component)
+        Component = Nodes[Node].Component;
+    }
+    return Component;
+  }
+
+  /// Returns the components whose uses count as uses within Id.
+  uint64_t getInternalMask(uint32_t Id) const {
+    return getBit(Id) | InternalMasks[Id - 1];
+  }
+
+  StringRef getName(uint32_t Id) const { return Names[Id - 1]; }
+
+  static uint64_t getBit(uint32_t Id) {
+    return Id ? uint64_t(1) << (Id - 1) : 0;
+  }
+
+private:
+  uint32_t getOrAddComponent(StringRef Name) {
+    auto It = std::find(Names.begin(), Names.end(), Name);
+    if (It != Names.end())
+      return It - Names.begin() + 1;
+    Names.push_back(Name.str());
+    InternalMasks.push_back(0);
+    return Names.size();
+  }
+
+  void addPrefix(StringRef Prefix, uint32_t Id) {
+    uint32_t Node = 0;
+    for (StringRef C : llvm::make_range(llvm::sys::path::begin(Prefix),
+                                        llvm::sys::path::end(Prefix))) {
+      auto Ins = Nodes[Node].Children.try_emplace(C, Nodes.size());
+      Node = Ins.first->second;
+      if (Ins.second)
+        Nodes.emplace_back();
+    }
+    Nodes[Node].Component = Id;
+  }
+
+  struct Node {
+    llvm::StringMap<uint32_t> Children;
+    uint32_t Component = 0;
+  };
+  std::vector<Node> Nodes = std::vector<Node>(1);
+  std::vector<std::string> Names;
+  std::vector<uint64_t> InternalMasks;
+};
+
+ComponentMap Components;
+
+static llvm::cl::opt<bool> HeaderFunctions(
+    "header-functions",
+    llvm::cl::desc("Also report inline and template functions in headers "
+                   "that only one translation unit uses, with the number of "
+                   "translation units that include the header"));
+
+static llvm::cl::opt<bool> HeaderWaste(
+    "header-waste",
+    llvm::cl::desc("Rank headers by the number of translation units that "
+                   "include them times the lines of unused definitions and "
+                   "declarations they contain"));
+
+/// Number of translation units that include each header, for
+/// -header-functions and -header-waste, and the main file of each
+/// translation unit, for -header-functions.
+llvm::StringMap<uint32_t> IncludeFanOut;
+std::vector<std::string> TUFiles;
+
+static llvm::cl::opt<unsigned> CallSites(
+    "call-sites",
+    llvm::cl::desc("Also report functions that are referenced from at most "
+                   "this many places in the whole program, with the caller "
+                   "of functions referenced only once (0 disables)"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<bool> VirtualFamilies(
+    "virtual-families",
+    llvm::cl::desc("Also report families of virtual methods, a method with "
+                   "everything it overrides and everything that overrides "
+                   "it, where no member is ever called"));
+
+/// Families of virtual methods across all TUs, merged by union-find over the
+/// override edges.
+class OverrideFamilies {
+public:
+  struct Member {
+    std::string Name;
+    std::string Filename;
+    unsigned Line = 0;
+    bool Overrides = false; // Overrides another member.
+    bool Used = false;
+  };
+
+  uint32_t getNode(const SymbolHash &Hash) {
+    auto Ins = Ids.try_emplace(Hash, Members.size());
+    if (Ins.second) {
+      Members.emplace_back();
+      Parent.push_back(Ins.first->second);
+    }
+    return Ins.first->second;
+  }
+  Member &getMember(uint32_t Node) { return Members[Node]; }
+
+  void unite(uint32_t A, uint32_t B) {
+    A = find(A);
+    B = find(B);
+    if (A != B)
+      Parent[std::max(A, B)] = std::min(A, B);
+  }
+
+  /// Returns the families without a used member, each with the methods
+  /// that don't override anything first.
+  std::vector<std::vector<uint32_t>> getUnusedFamilies() {
+    std::vector<uint32_t> Order(Members.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    for (uint32_t &Root : Parent)
+      Root = find(Root);
+    std::stable_sort(Order.begin(), Order.end(), [&](uint32_t A, uint32_t B) {
+      return std::tie(Parent[A], Members[A].Overrides, Members[A].Name) <
+             std::tie(Parent[B], Members[B].Overrides, Members[B].Name);
+    });
+
+    std::vector<std::vector<uint32_t>> Unused;
+    for (auto Begin = Order.begin(); Begin != Order.end();) {
+      auto End = std::find_if(Begin, Order.end(), [&](uint32_t N) {
+        return Parent[N] != Parent[*Begin];
+      });
+      if (std::none_of(Begin, End,
+                       [&](uint32_t N) { return Members[N].Used; }))
+        Unused.emplace_back(Begin, End);
+      Begin = End;
+    }
+    return Unused;
+  }
+
+private:
+  uint32_t find(uint32_t N) {
+    while (Parent[N] != N)
+      N = Parent[N] = Parent[Parent[N]];
+    return N;
+  }
+
+  llvm::DenseMap<SymbolHash, uint32_t> Ids;
+  std::vector<uint32_t> Parent;
+  std::vector<Member> Members;
+};
+
+static llvm::cl::list<std::string> ExportedSymbolFiles(
+    "exported-symbols",
+    llvm::cl::desc("Shared library or linker version script; the symbols it "
+                   "exports are used from outside of the project"),
+    llvm::cl::value_desc("file"));
+
+/// The symbols exported from the project's shared libraries, by mangled
+/// name, for -exported-symbols. ELF shared libraries and executables
+/// contribute the defined symbols of their .dynsym table. Version scripts
+/// contribute the names and glob patterns of their global sections; patterns
+/// in extern "C++" blocks match demangled names.
+class ExportedSymbols {
+public:
+  llvm::Error load(StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return llvm::createStringError(Buffer.getError(),
+                                     "cannot read '%s': %s",
+                                     Path.str().c_str(),
+                                     Buffer.getError().message().c_str());
+    llvm::file_magic Magic = llvm::identify_magic((*Buffer)->getBuffer());
+    if (Magic == llvm::file_magic::unknown) {
+      loadVersionScript((*Buffer)->getBuffer());
+      return llvm::Error::success();
+    }
+    // Executables export symbols too, with -rdynamic.
+    if (Magic != llvm::file_magic::elf_shared_object &&
+        Magic != llvm::file_magic::elf_executable)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "'%s' is neither an ELF shared library "
+                                     "or executable nor a version script",
+                                     Path.str().c_str());
+    auto Obj = llvm::object::ObjectFile::createObjectFile(**Buffer);
+    if (!Obj)
+      return Obj.takeError();
+    const auto *ELF = dyn_cast<llvm::object::ELFObjectFileBase>(Obj->get());
+    if (!ELF)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "'%s' is not an ELF file",
+                                     Path.str().c_str());
+    for (const auto &Sym : ELF->getDynamicSymbolIterators()) {
+      auto Flags = Sym.getFlags();
+      if (!Flags)
+        return Flags.takeError();
+      if (*Flags & llvm::object::SymbolRef::SF_Undefined)
+        continue;
+      auto Name = Sym.getName();
+      if (!Name)
+        return Name.takeError();
+      if (!Name->empty())
+        Names.insert(*Name);
+    }
+    return llvm::Error::success();
+  }
+
+  /// Compiles the patterns; call once after loading all files.
+  llvm::Error finish() {
+    for (auto *P : {&Patterns, &CxxPatterns}) {
+      if (P->Source.empty())
+        continue;
+      P->Regex = std::make_unique<llvm::Regex>("^(" + P->Source + ")$");
+      std::string Error;
+      if (!P->Regex->isValid(Error))
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "invalid version script pattern: %s",
+                                       Error.c_str());
+    }
+    return llvm::Error::success();
+  }
+
+  bool empty() const {
+    return Names.empty() && CxxNames.empty() && !Patterns.Regex &&
+           !CxxPatterns.Regex;
+  }
+  size_t size() const { return Names.size() + CxxNames.size(); }
+
+  bool contains(StringRef MangledName) const {
+    if (Names.count(MangledName) ||
+        (Patterns.Regex && Patterns.Regex->match(MangledName)))
+      return true;
+    if (CxxNames.empty() && !CxxPatterns.Regex)
+      return false;
+    std::string Demangled = llvm::demangle(MangledName.str());
+    return CxxNames.count(Demangled) ||
+           (CxxPatterns.Regex && CxxPatterns.Regex->match(Demangled));
+  }
+
+private:
+  struct PatternSet {
+    std::string Source;
+    std::unique_ptr<llvm::Regex> Regex;
+  };
+
+  /// Reads the global entries of a version script like
+  ///   VERS_1 { global: foo; extern "C++" { ns::*; }; local: *; };
+  void loadVersionScript(StringRef Text) {
+    bool Global = true, Cxx = false;
+    unsigned Depth = 0, CxxDepth = 0;
+    while (!Text.empty()) {
+      Text = Text.ltrim();
+      if (Text.consume_front("/*")) {
+        size_t End = Text.find("*/");
+        Text = End == StringRef::npos ? StringRef() : Text.drop_front(End + 2);
+        continue;
+      }
+      if (Text.startswith("#")) {
+        Text = Text.drop_until([](char C) { return C == '\n'; });
+        continue;
+      }
+      if (Text.empty())
+        break;
+      // Labels may also be written as "global :" or "global:foo;".
+      StringRef Label = Text.take_while(llvm::isAlpha);
+      if (Label == "global" || Label == "local") {
+        StringRef Rest = Text.drop_front(Label.size()).ltrim();
+        if (Rest.startswith(":") && !Rest.startswith("::")) {
+          Global = Label == "global";
+          Text = Rest.drop_front();
+          continue;
+        }
+      }
+      char C = Text.front();
+      if (C == '{' || C == '}' || C == ';') {
+        Text = Text.drop_front();
+        if (C == '{')
+          ++Depth;
+        else if (C == '}' && Depth) {
+          if (Cxx && Depth == CxxDepth)
+            Cxx = false;
+          --Depth;
+        }
+        continue;
+      }
+      StringRef Token;
+      if (C == '"') {
+        size_t End = Text.find('"', 1);
+        Token = Text.slice(0, End == StringRef::npos ? Text.size() : End + 1);
+      } else {
+        Token = Text.take_until([](char C) {
+          return isspace(static_cast<unsigned char>(C)) || C == '{' ||
+                 C == '}' || C == ';';
+        });
+      }
+      Text = Text.drop_front(Token.size());
+      if (Token == "extern") {
+        // The language follows; only C++ needs demangling.
+        Text = Text.ltrim();
+        if (Text.consume_front("\"C++\"")) {
+          Cxx = true;
+          CxxDepth = Depth + 1;
+        } else if (Text.startswith("\"")) {
+          Text = Text.drop_front().drop_until([](char C) { return C == '"'; });
+          Text = Text.drop_front();
+        }
+      } else if (Depth && Global) {
+        addName(Token.trim('"'), Cxx, /*Quoted=*/Token.startswith("\""));
+      }
+    }
+  }
+
+  void addName(StringRef Name, bool Cxx, bool Quoted) {
+    if (Name.empty())
+      return;
+    if (Quoted || Name.find_first_of("*?[") == StringRef::npos) {
+      (Cxx ? CxxNames : Names).insert(Name);
+      return;
+    }
+    // Convert the glob to a regular expression.
+    std::string Regex;
+    for (size_t I = 0; I != Name.size(); ++I) {
+      char C = Name[I];
+      if (C == '*') {
+        Regex += ".*";
+        continue;
+      }
+      if (C == '?') {
+        Regex += '.';
+        continue;
+      }
+      if (C == '[') {
+        // Bracket expressions are copied, but globs negate them with '!'.
+        // A ']' right after the opening bracket is part of the set.
+        size_t Start = I + 1;
+        if (Start < Name.size() && Name[Start] == '!')
+          ++Start;
+        size_t End = Name.find(']', Start + 1);
+        if (End != StringRef::npos) {
+          Regex += Start == I + 2 ? "[^" : "[";
+          Regex += Name.slice(Start, End + 1);
+          I = End;
+          continue;
+        }
+      }
+      Regex += llvm::Regex::escape(StringRef(&C, 1));
+    }
+    PatternSet &P = Cxx ? CxxPatterns : Patterns;
+    P.Source += (P.Source.empty() ? "(" : "|(") + Regex + ")";
+  }
+
+  llvm::StringSet<> Names;
+  llvm::StringSet<> CxxNames;
+  PatternSet Patterns;
+  PatternSet CxxPatterns;
+};
+
+static llvm::cl::opt<std::string> IndexFile(
+    "index-file",
+    llvm::cl::desc("Write the uses of every function and variable to this "
+                   "file; 'xunused why <symbol> -index-file=<file>' prints "
+                   "them"),
+    llvm::cl::value_desc("file"));
+
+/// Reverse references for -index-file: for each symbol, the functions, or
+/// the translation units for uses outside of functions, that use it, and
+/// where. Names and filenames are interned, and references are appended as
+/// LEB128 ids while the TUs are processed, into buckets of targets. Every
+/// TU that includes a header reports most of the references in it again, so
+/// a bucket is sorted and deduplicated whenever it has doubled in size.
+///
+/// The file has the interned strings, the name and number of references of
+/// each symbol, and the references of all symbols in CSR form: the offsets
+/// of each symbol's references into one blob. References are sorted by
+/// location and store the deltas of the file id and line to their
+/// predecessor.
+class ReferenceIndex {
+public:
+  uint32_t getString(StringRef S) {
+    auto Ins = StringIds.try_emplace(S, Strings.size());
+    if (Ins.second)
+      Strings.push_back(Ins.first->getKey());
+    return Ins.first->second;
+  }
+
+  uint32_t getTarget(const SymbolHash &Hash, StringRef Name) {
+    auto Ins = TargetIds.try_emplace(Hash, TargetNames.size());
+    if (Ins.second)
+      TargetNames.push_back(getString(Name));
+    return Ins.first->second;
+  }
+
+  void add(uint32_t Target, uint32_t User, uint32_t File, unsigned Line) {
+    size_t Bucket = Target >> BucketShift;
+    if (Buckets.size() <= Bucket)
+      Buckets.resize(Bucket + 1);
+    BucketData &D = Buckets[Bucket];
+    llvm::raw_string_ostream OS(D.Data);
+    RecordWriter W(OS);
+    W.writeInt(Target & ((1u << BucketShift) - 1));
+    W.writeInt(File);
+    W.writeInt(Line);
+    W.writeInt(User);
+    OS.flush();
+    ++D.NumRefs;
+    ++NumReferences;
+    if (D.Data.size() > 2 * std::max<size_t>(D.CompactSize, 1 << 16)) {
+      std::vector<Ref> Refs;
+      decodeBucket(Bucket, Refs);
+      NumReferences -= D.NumRefs - Refs.size();
+      D.Data.clear();
+      llvm::raw_string_ostream Compact(D.Data);
+      RecordWriter CW(Compact);
+      for (const Ref &R : Refs) {
+        CW.writeInt(R.Target - (Bucket << BucketShift));
+        CW.writeInt(R.File);
+        CW.writeInt(R.Line);
+        CW.writeInt(R.User);
+      }
+      Compact.flush();
+      D.CompactSize = D.Data.size();
+      D.NumRefs = Refs.size();
+    }
+  }
+
+  llvm::Error write(StringRef Path) {
+    std::vector<uint64_t> Counts(TargetNames.size()), Offsets{0};
+    std::string Blob;
+    llvm::raw_string_ostream BlobStream(Blob);
+    RecordWriter B(BlobStream);
+    std::vector<Ref> Refs;
+    NumReferences = 0;
+    for (size_t Bucket = 0; Bucket != Buckets.size(); ++Bucket) {
+      uint32_t Base = Bucket << BucketShift;
+      decodeBucket(Bucket, Refs);
+      std::string().swap(Buckets[Bucket].Data);
+      NumReferences += Refs.size();
+
+      auto It = Refs.begin();
+      uint32_t End = std::min<size_t>(Base + (1u << BucketShift),
+                                      TargetNames.size());
+      for (uint32_t Target = Base; Target != End; ++Target) {
+        uint32_t PrevFile = 0, PrevLine = 0;
+        for (; It != Refs.end() && It->Target == Target; ++It) {
+          B.writeInt(It->File - PrevFile);
+          B.writeInt(It->File == PrevFile ? It->Line - PrevLine : It->Line);
+          B.writeInt(It->User);
+          PrevFile = It->File;
+          PrevLine = It->Line;
+          ++Counts[Target];
+        }
+        Offsets.push_back(BlobStream.str().size());
+      }
+    }
+    // Targets after the last bucket with references have none.
+    Offsets.resize(TargetNames.size() + 1, Offsets.back());
+
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC);
+    if (EC)
+      return llvm::createStringError(EC, "cannot write '%s': %s",
+                                     Path.str().c_str(), EC.message().c_str());
+    RecordWriter W(OS);
+    W.writeString(Magic);
+    W.writeInt(Strings.size());
+    for (StringRef S : Strings)
+      W.writeString(S);
+    W.writeInt(TargetNames.size());
+    for (uint32_t Target = 0; Target != TargetNames.size(); ++Target) {
+      W.writeInt(TargetNames[Target]);
+      W.writeInt(Counts[Target]);
+    }
+    for (uint64_t Offset : Offsets)
+      W.writeInt(Offset);
+    W.writeString(BlobStream.str());
+    return llvm::Error::success();
+  }
+
+  /// Prints the references to the symbols named Name from an index file.
+  static llvm::Error query(StringRef Path, StringRef Name,
+                           llvm::raw_ostream &OS) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return llvm::createStringError(Buffer.getError(),
+                                     "cannot read '%s': %s",
+                                     Path.str().c_str(),
+                                     Buffer.getError().message().c_str());
+    auto Corrupt = [&] {
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "'%s' is not a valid index file",
+                                     Path.str().c_str());
+    };
+    RecordReader R((*Buffer)->getBuffer());
+    std::string FileMagic;
+    uint64_t NumStrings, NumTargets;
+    if (!R.readString(FileMagic) || FileMagic != Magic ||
+        !R.readInt(NumStrings))
+      return Corrupt();
+    std::vector<std::string> Strings(NumStrings);
+    for (std::string &S : Strings)
+      if (!R.readString(S))
+        return Corrupt();
+    if (!R.readInt(NumTargets))
+      return Corrupt();
+    std::vector<std::pair<uint64_t, uint64_t>> Targets(NumTargets);
+    for (auto &T : Targets)
+      if (!R.readInt(T.first) || !R.readInt(T.second) ||
+          T.first >= NumStrings)
+        return Corrupt();
+    std::vector<uint64_t> Offsets(NumTargets + 1);
+    for (uint64_t &Offset : Offsets)
+      if (!R.readInt(Offset))
+        return Corrupt();
+    uint64_t BlobSize;
+    StringRef Blob;
+    if (!R.readInt(BlobSize) || !R.readBytes(BlobSize, Blob) ||
+        Offsets.back() != BlobSize)
+      return Corrupt();
+
+    bool Found = false;
+    for (size_t Target = 0; Target != NumTargets; ++Target) {
+      if (Strings[Targets[Target].first] != Name)
+        continue;
+      Found = true;
+      if (Offsets[Target] > Offsets[Target + 1])
+        return Corrupt();
+      OS << "'" << Name << "' has " << Targets[Target].second
+         << (Targets[Target].second == 1 ? " use" : " uses") << ":\n";
+      RecordReader Refs(Blob.slice(Offsets[Target], Offsets[Target + 1]));
+      uint64_t File = 0, Line = 0;
+      while (!Refs.atEnd()) {
+        uint64_t FileDelta, LineDelta, User;
+        if (!Refs.readInt(FileDelta) || !Refs.readInt(LineDelta) ||
+            !Refs.readInt(User) || File + FileDelta >= NumStrings ||
+            User >= NumStrings)
+          return Corrupt();
+        Line = FileDelta ? LineDelta : Line + LineDelta;
+        File += FileDelta;
+        OS << Strings[File] << ":" << Line << ": note: used by '"
+           << Strings[User] << "'\n";
+      }
+    }
+    if (!Found)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "'%s' has no uses in '%s'",
+                                     Name.str().c_str(), Path.str().c_str());
+    return llvm::Error::success();
+  }
+
+  size_t size() const { return NumReferences; }
+
+private:
+  struct Ref {
+    uint32_t Target, File, Line, User;
+    bool operator<(const Ref &O) const {
+      return std::tie(Target, File, Line, User) <
+             std::tie(O.Target, O.File, O.Line, O.User);
+    }
+    bool operator==(const Ref &O) const {
+      return std::tie(Target, File, Line, User) ==
+             std::tie(O.Target, O.File, O.Line, O.User);
+    }
+  };
+
+  /// Encoded references of the targets [I << BucketShift, (I + 1) <<
+  /// BucketShift), by the target's offset in the bucket, and their number.
+  /// CompactSize is the size after the last deduplication.
+  struct BucketData {
+    std::string Data;
+    size_t CompactSize = 0;
+    size_t NumRefs = 0;
+  };
+
+  /// Decodes the references of a bucket, sorted and without duplicates. A
+  /// location may be referenced by many TUs and instantiations.
+  void decodeBucket(size_t Bucket, std::vector<Ref> &Refs) const {
+    Refs.clear();
+    uint32_t Base = Bucket << BucketShift;
+    RecordReader R(Buckets[Bucket].Data);
+    Ref X;
+    while (R.readInt(X.Target) && R.readInt(X.File) && R.readInt(X.Line) &&
+           R.readInt(X.User)) {
+      X.Target += Base;
+      Refs.push_back(X);
+    }
+    assert(R.atEnd() && "corrupt reference data");
+    std::sort(Refs.begin(), Refs.end());
+    Refs.erase(std::unique(Refs.begin(), Refs.end()), Refs.end());
+  }
+
+  static constexpr const char *Magic = "xunused-index-1";
+
+  llvm::StringMap<uint32_t> StringIds;
+  std::vector<StringRef> Strings;
+  llvm::DenseMap<SymbolHash, uint32_t> TargetIds;
+  std::vector<uint32_t> TargetNames;
+  static constexpr unsigned BucketShift = 12;
+  std::vector<BucketData> Buckets;
+  size_t NumReferences = 0;
+};
+
+static llvm::cl::list<std::string> TimeTraces(
+    "time-trace",
+    llvm::cl::desc("JSON file written by -ftime-trace in a build of the "
+                   "project, or a directory with such files; report the "
+                   "frontend time spent on each unused definition"),
+    llvm::cl::value_desc("file or directory"));
+
+static llvm::cl::opt<bool> SortByCompileTime(
+    "sort-by-compile-time",
+    llvm::cl::desc("Report the unused definitions that cost the most "
+                   "compile time first (needs -time-trace)"));
+
+/// Frontend time per declaration, read from -ftime-trace files. Each scope
+/// of Sema or the parser that names a declaration is attributed its self
+/// time, without the time of nested scopes. Instantiations are attributed
+/// to their template by stripping the template arguments. The parser names
+/// function definitions and templates without their scope; these are only
+/// attributed when they are nested in the scope of the class that declares
+/// them, as an unqualified name could be any of several declarations.
+/// Names carry no parameter types, so a name's time is only reported for
+/// a definition if no other definition has that name.
+class CompileTimes {
+public:
+  struct Cost {
+    uint64_t Micros = 0;
+    uint32_t TUs = 0;
+  };
+
+  llvm::Error load(StringRef Path) {
+    std::vector<std::string> Files;
+    if (!llvm::sys::fs::is_directory(Path)) {
+      Files.push_back(Path.str());
+    } else {
+      std::error_code EC;
+      for (llvm::sys::fs::recursive_directory_iterator It(Path, EC), End;
+           It != End && !EC; It.increment(EC))
+        if (llvm::sys::path::extension(It->path()) == ".json")
+          Files.push_back(It->path());
+      if (EC)
+        return llvm::createStringError(EC, "cannot read '%s': %s",
+                                       Path.str().c_str(),
+                                       EC.message().c_str());
+    }
+
+    std::mutex ErrorMutex;
+    llvm::Error Err = llvm::Error::success();
+    llvm::parallelForEach(Files, [&](const std::string &File) {
+      if (auto FileErr = loadFile(File)) {
+        std::lock_guard<std::mutex> Lock(ErrorMutex);
+        Err = llvm::joinErrors(std::move(Err), std::move(FileErr));
+      }
+    });
+    return Err;
+  }
+
+  /// Returns the time attributed to a declaration by its qualified name.
+  Cost lookup(StringRef QualifiedName) const {
+    return Costs.lookup(QualifiedName);
+  }
+
+  bool empty() const { return Costs.empty(); }
+
+private:
+  llvm::Error loadFile(StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return llvm::createStringError(Buffer.getError(),
+                                     "cannot read '%s': %s",
+                                     Path.str().c_str(),
+                                     Buffer.getError().message().c_str());
+    auto Trace = llvm::json::parse((*Buffer)->getBuffer());
+    if (!Trace)
+      return llvm::createStringError(
+          llvm::inconvertibleErrorCode(), "'%s': %s", Path.str().c_str(),
+          llvm::toString(Trace.takeError()).c_str());
+    const llvm::json::Object *Root = Trace->getAsObject();
+    const llvm::json::Array *Events =
+        Root ? Root->getArray("traceEvents") : nullptr;
+    if (!Events)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "'%s' is not a time trace",
+                                     Path.str().c_str());
+
+    struct Event {
+      int64_t Tid, Begin, End;
+      StringRef Name, Detail;
+      int64_t Self;
+      std::string Key;
+    };
+    std::vector<Event> Scopes;
+    for (const llvm::json::Value &V : *Events) {
+      const llvm::json::Object *E = V.getAsObject();
+      if (!E)
+        continue;
+      auto Ph = E->getString("ph");
+      auto Name = E->getString("name");
+      auto Tid = E->getInteger("tid");
+      auto Ts = E->getNumber("ts");
+      auto Dur = E->getNumber("dur");
+      if (!Ph || *Ph != "X" || !Name || Name->startswith("Total ") || !Tid ||
+          !Ts || !Dur)
+        continue;
+      StringRef Detail;
+      if (isDeclScope(*Name))
+        if (const llvm::json::Object *Args = E->getObject("args"))
+          if (auto D = Args->getString("detail"))
+            Detail = *D;
+      Scopes.push_back({*Tid, int64_t(*Ts), int64_t(*Ts + *Dur), *Name, Detail,
+                        int64_t(*Dur), {}});
+    }
+
+    // Scopes nest; subtract each scope from its parent's self time.
+    std::sort(Scopes.begin(), Scopes.end(), [](const Event &A, const Event &B) {
+      return std::make_tuple(A.Tid, A.Begin, -A.End) <
+             std::make_tuple(B.Tid, B.Begin, -B.End);
+    });
+    std::vector<Event *> Stack;
+    for (Event &E : Scopes) {
+      while (!Stack.empty() &&
+             (Stack.back()->Tid != E.Tid || Stack.back()->End <= E.Begin))
+        Stack.pop_back();
+      if (!Stack.empty())
+        Stack.back()->Self -= E.End - E.Begin;
+      if (!E.Detail.empty()) {
+        if (!isUnqualifiedScope(E.Name)) {
+          E.Key = stripTemplateArgs(E.Detail);
+        } else {
+          // Qualify the name by the enclosing class, if the innermost
+          // enclosing declaration is one.
+          auto Parent = std::find_if(
+              Stack.rbegin(), Stack.rend(),
+              [](const Event *P) { return !P->Detail.empty(); });
+          if (Parent != Stack.rend() && (*Parent)->Name == "ParseClass")
+            E.Key = (*Parent)->Key + "::" + stripTemplateArgs(E.Detail);
+        }
+      }
+      Stack.push_back(&E);
+    }
+
+    llvm::StringMap<uint64_t> FileCosts;
+    for (const Event &E : Scopes)
+      if (!E.Key.empty() && E.Self > 0)
+        FileCosts[E.Key] += E.Self;
+
+    std::lock_guard<std::mutex> Lock(CostsMutex);
+    for (const auto &KV : FileCosts) {
+      Cost &C = Costs[KV.getKey()];
+      C.Micros += KV.getValue();
+      ++C.TUs;
+    }
+    return llvm::Error::success();
+  }
+
+  static bool isDeclScope(StringRef Name) {
+    return Name == "ParseClass" || Name == "ParseTemplate" ||
+           Name == "ParseFunctionDefinition" || Name == "InstantiateClass" ||
+           Name == "InstantiateFunction" || Name == "CodeGen Function" ||
+           Name == "DebugType";
+  }
+
+  /// Returns true for the scopes whose detail is an unqualified name.
+  static bool isUnqualifiedScope(StringRef Name) {
+    return Name == "ParseFunctionDefinition" || Name == "ParseTemplate";
+  }
+
+  /// Turns "ns::Foo<int>::bar<char>" into "ns::Foo::bar".
+  static std::string stripTemplateArgs(StringRef Name) {
+    std::string Result;
+    unsigned Depth = 0;
+    for (size_t I = 0; I != Name.size(); ++I) {
+      char C = Name[I];
+      if (C == '<' && !StringRef(Result).endswith("operator") &&
+          !StringRef(Result).endswith("operator<")) {
+        ++Depth;
+        continue;
+      }
+      if (Depth) {
+        if (C == '>')
+          --Depth;
+        continue;
+      }
+      Result += C;
+    }
+    return Result;
+  }
+
+  std::mutex CostsMutex;
+  llvm::StringMap<Cost> Costs;
+};
+
+static llvm::cl::opt<std::string> ProfileFile(
+    "profile",
+    llvm::cl::desc("Indexed profile (.profdata) of the program in production; "
+                   "also report functions that are used but never ran"),
+    llvm::cl::value_desc("file"));
+
+/// Whether the functions in a -profile ran, keyed by the MD5 of their
+/// mangled name. Functions with internal linkage are recorded as
+/// "<file>;<name>" (or "<file>:<name>" by older compilers) and only looked
+/// up by their name, so a function counts as executed if any function of
+/// that name ran.
+class ProfileCounts {
+public:
+  enum State { NotProfiled, NeverExecuted, Executed };
+
+  llvm::Error load(StringRef Path) {
+#if CLANG_VERSION_MAJOR >= 17
+    auto FS = llvm::vfs::getRealFileSystem();
+    auto Reader = llvm::IndexedInstrProfReader::create(Path, *FS);
+#else
+    auto Reader = llvm::IndexedInstrProfReader::create(Path);
+#endif
+    if (!Reader)
+      return Reader.takeError();
+    // The records are read one by one from the on-disk hash table.
+    for (const llvm::NamedInstrProfRecord &Record : **Reader) {
+      bool Ran = llvm::any_of(Record.Counts, [](uint64_t C) { return C; });
+      StringRef Name = Record.Name;
+      size_t Prefix = Name.find_last_of(";:");
+      if (Prefix != StringRef::npos)
+        Name = Name.substr(Prefix + 1);
+      bool &Executed = States[llvm::MD5Hash(Name)];
+      Executed |= Ran;
+    }
+    return (*Reader)->getError();
+  }
+
+  bool empty() const { return States.empty(); }
+
+  State lookup(StringRef MangledName) const {
+    auto It = States.find(llvm::MD5Hash(MangledName));
+    if (It == States.end())
+      return NotProfiled;
+    return It->second ? Executed : NeverExecuted;
+  }
+
+private:
+  llvm::DenseMap<uint64_t, bool> States;
+};
+
+static llvm::cl::list<std::string> ScanPaths(
+    "scan",
+    llvm::cl::desc("File, or directory to search recursively, with code "
+                   "other than C and C++, like assembly, linker scripts or "
+                   "Python; functions and variables whose symbol name it "
+                   "contains are used"),
+    llvm::cl::value_desc("file or directory"));
+
+/// Finds which of a set of symbol names occur in files as whole
+/// identifiers, for -scan. Splitting the files into identifiers and looking
+/// each one up in a hash table finds the same occurrences as a
+/// multi-pattern automaton with boundary checks, with memory proportional
+/// to the names. Files are memory-mapped and scanned in parallel.
+class SymbolScanner {
+public:
+  /// Adds a name to search for and returns its id.
+  uint32_t add(StringRef Name) {
+    auto Ins = Ids.try_emplace(Name, Ids.size());
+    MinLength = std::min(MinLength, Name.size());
+    MaxLength = std::max(MaxLength, Name.size());
+    Filter.set(getFilterBit(Name));
+    return Ins.first->second;
+  }
+
+  llvm::Error scan(ArrayRef<std::string> Paths) {
+    // Files in directories are only scanned if they are text; files given
+    // explicitly are always scanned.
+    std::vector<std::pair<std::string, bool>> Files;
+    for (const std::string &Path : Paths) {
+      if (!llvm::sys::fs::is_directory(Path)) {
+        Files.emplace_back(Path, /*OnlyText=*/false);
+        continue;
+      }
+      std::error_code EC;
+      for (llvm::sys::fs::recursive_directory_iterator It(Path, EC), End;
+           It != End && !EC; It.increment(EC)) {
+        // Skip hidden files and directories like .git.
+        if (llvm::sys::path::filename(It->path()).startswith(".")) {
+          It.no_push();
+          continue;
+        }
+        if (It->type() != llvm::sys::fs::file_type::directory_file &&
+            !isCxxSource(It->path()))
+          Files.emplace_back(It->path(), /*OnlyText=*/true);
+      }
+      if (EC)
+        return llvm::createStringError(EC, "cannot read '%s': %s",
+                                       Path.c_str(), EC.message().c_str());
+    }
+
+    Found.reset(new std::atomic<bool>[Ids.size()]());
+    std::mutex ErrorMutex;
+    llvm::Error Err = llvm::Error::success();
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> LargeFiles;
+    llvm::parallelForEach(Files, [&](const std::pair<std::string, bool> &F) {
+      const std::string &File = F.first;
+      auto Buffer = llvm::MemoryBuffer::getFile(
+          File, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+      std::unique_lock<std::mutex> Lock(ErrorMutex, std::defer_lock);
+      if (!Buffer) {
+        Lock.lock();
+        Err = llvm::joinErrors(
+            std::move(Err),
+            llvm::createStringError(Buffer.getError(), "cannot read '%s': %s",
+                                    File.c_str(),
+                                    Buffer.getError().message().c_str()));
+        return;
+      }
+      // Object files, archives and executables in build directories.
+      if (F.second && llvm::identify_magic((*Buffer)->getBuffer()) !=
+                          llvm::file_magic::unknown)
+        return;
+      ++FilesScanned;
+      BytesScanned += (*Buffer)->getBufferSize();
+      if ((*Buffer)->getBufferSize() > ChunkSize) {
+        Lock.lock();
+        LargeFiles.push_back(std::move(*Buffer));
+        return;
+      }
+      scanBuffer((*Buffer)->getBuffer());
+    });
+
+    // Large files are split between identifiers into chunks that are
+    // scanned in parallel.
+    for (const auto &Buffer : LargeFiles) {
+      std::vector<StringRef> Chunks;
+      StringRef Text = Buffer->getBuffer();
+      while (!Text.empty()) {
+        size_t End = std::min(ChunkSize, Text.size());
+        while (End != Text.size() && isIdentifierChar(Text[End]))
+          ++End;
+        Chunks.push_back(Text.take_front(End));
+        Text = Text.drop_front(End);
+      }
+      llvm::parallelForEach(Chunks,
+                            [&](StringRef Chunk) { scanBuffer(Chunk); });
+    }
+    return Err;
+  }
+
+  bool isFound(uint32_t Id) const {
+    return Found[Id].load(std::memory_order_relaxed);
+  }
+
+  size_t getFilesScanned() const { return FilesScanned; }
+  uint64_t getBytesScanned() const { return BytesScanned; }
+
+private:
+  static bool isIdentifierChar(char C) {
+    return llvm::isAlnum(C) || C == '_' || C == '$';
+  }
+
+  /// Rejects most identifiers before the hash table lookup by their length
+  /// and first and last characters.
+  static size_t getFilterBit(StringRef Name) {
+    return (Name.size() & 63) << 10 |
+           ((uint8_t(Name.front()) * 31 + uint8_t(Name.back())) & 1023);
+  }
+
+  static bool isCxxSource(StringRef Path) {
+    return llvm::StringSwitch<bool>(llvm::sys::path::extension(Path))
+        .Cases(".c", ".cc", ".cpp", ".cxx", ".c++", true)
+        .Cases(".h", ".hh", ".hpp", ".hxx", ".inc", ".inl", ".ipp", true)
+        .Default(false);
+  }
+
+  void scanBuffer(StringRef Text) {
+    const char *P = Text.begin(), *End = Text.end();
+    while (P != End) {
+      if (!isIdentifierChar(*P)) {
+        ++P;
+        continue;
+      }
+      const char *Begin = P;
+      while (P != End && isIdentifierChar(*P))
+        ++P;
+      size_t Length = P - Begin;
+      StringRef Identifier(Begin, Length);
+      if (Length < MinLength || Length > MaxLength ||
+          !Filter.test(getFilterBit(Identifier)))
+        continue;
+      auto It = Ids.find(Identifier);
+      if (It != Ids.end())
+        Found[It->second].store(true, std::memory_order_relaxed);
+    }
+  }
+
+  static constexpr size_t ChunkSize = 8 << 20;
+
+  llvm::StringMap<uint32_t> Ids;
+  std::bitset<1 << 16> Filter;
+  size_t MinLength = SIZE_MAX, MaxLength = 0;
+  std::unique_ptr<std::atomic<bool>[]> Found;
+  std::atomic<size_t> FilesScanned{0};
+  std::atomic<uint64_t> BytesScanned{0};
+};
+
+std::mutex Mutex;
+SymbolTable AllDecls;
+CallGraph Calls;
+OverrideFamilies Families;
+std::unique_ptr<llvm::Regex> RootRegex; // From -root.
+ExportedSymbols Exports;
+ReferenceIndex Index;
+CompileTimes FrontendTimes;
+ProfileCounts Profile;
+
+/// A set of USRs, each with its SymbolHash, stored sorted in blocks of
+/// BlockSize strings. The first USR of a block is stored in full; every
+/// other USR only stores the length of the prefix it shares with its
+/// predecessor and the remaining suffix. USRs share long prefixes
+/// (c:@N@ns@S@Class@F@...), so this takes a fraction of the memory of
+/// separate std::strings. New USRs are collected unsorted and merged into
+/// the blocks in batches.
+class USRTable {
+public:
+  /// Adds \p USR with hash \p Hash. If \p USR is already present with a
+  /// different hash, the first hash is kept and OnConflict is called.
+  void insert(StringRef USR, const SymbolHash &Hash) {
+    Pending.push_back({PendingChars.size(), USR.size(), Hash});
+    PendingChars.append(USR.begin(), USR.end());
+    if (Pending.size() >= MaxPending)
+      compact();
+  }
+
+  /// Looks up the hash of \p USR among the USRs that were already merged into
+  /// the blocks.
+  bool lookup(StringRef USR, SymbolHash &Hash) const {
+    // Find the last block whose first USR is not greater than USR.
+    size_t Lo = 0, Hi = BlockOffsets.size();
+    while (Lo < Hi) {
+      size_t Mid = Lo + (Hi - Lo) / 2;
+      if (getFirstString(Mid) <= USR)
+        Lo = Mid + 1;
+      else
+        Hi = Mid;
+    }
+    if (Lo == 0)
+      return false;
+
+    size_t Index = (Lo - 1) * BlockSize;
+    BlockCursor Cursor(*this, Lo - 1);
+    SmallString<256> S;
+    for (; Cursor.next(S); ++Index) {
+      if (S == USR) {
+        Hash = Hashes[Index];
+        return true;
+      }
+      if (USR < S)
+        break;
+    }
+    return false;
+  }
+
+  /// Merges all pending USRs into the blocks.
+  void compact() {
+    if (Pending.empty())
+      return;
+    std::sort(Pending.begin(), Pending.end(),
+              [&](const PendingUSR &A, const PendingUSR &B) {
+                return getPendingString(A) < getPendingString(B);
+              });
+
+    USRTable Merged;
+    Merged.OnConflict = std::move(OnConflict);
+    SmallString<256> S;
+    size_t Index = 0, P = 0;
+    for (size_t Block = 0; Block != BlockOffsets.size(); ++Block) {
+      BlockCursor Cursor(*this, Block);
+      while (Cursor.next(S)) {
+        for (; P != Pending.size() && getPendingString(Pending[P]) < S; ++P)
+          Merged.append(getPendingString(Pending[P]), Pending[P].Hash);
+        Merged.append(S, Hashes[Index++]);
+      }
+    }
+    for (; P != Pending.size(); ++P)
+      Merged.append(getPendingString(Pending[P]), Pending[P].Hash);
+
+    Merged.Data.shrink_to_fit();
+    Merged.Hashes.shrink_to_fit();
+    *this = std::move(Merged);
+  }
+
+  size_t size() const { return Hashes.size(); }
+
+  /// Returns the USR with index \p Index in sort order. Only valid after
+  /// compact().
+  StringRef getString(size_t Index, SmallVectorImpl<char> &S) const {
+    BlockCursor Cursor(*this, Index / BlockSize);
+    for (size_t I = 0, E = Index % BlockSize; I <= E; ++I)
+      Cursor.next(S);
+    return StringRef(S.data(), S.size());
+  }
+  const SymbolHash &getHash(size_t Index) const { return Hashes[Index]; }
+
+  /// Number of bytes used for the merged USRs, and the number of bytes they
+  /// would take as separate std::strings.
+  size_t getMemorySize() const {
+    return Data.capacity() + BlockOffsets.capacity() * sizeof(size_t) +
+           Hashes.capacity() * sizeof(SymbolHash);
+  }
+  size_t getUncompressedSize() const { return UncompressedSize; }
+
+  std::function<void(StringRef USR, const SymbolHash &Kept,
+                     const SymbolHash &Dropped)>
+      OnConflict;
+
+private:
+  static constexpr unsigned BlockSize = 16;
+  static constexpr size_t MaxPending = 1 << 16;
+
+  struct PendingUSR {
+    size_t Offset;
+    size_t Size;
+    SymbolHash Hash;
+  };
+
+  /// Decodes the USRs of one block in order.
+  class BlockCursor {
+  public:
+    BlockCursor(const USRTable &T, size_t Block)
+        : Cur(reinterpret_cast<const uint8_t *>(T.Data.data()) +
+              T.BlockOffsets[Block]),
+          End(reinterpret_cast<const uint8_t *>(T.Data.data()) +
+              (Block + 1 < T.BlockOffsets.size() ? T.BlockOffsets[Block + 1]
+                                                 : T.Data.size())) {}
+
+    bool next(SmallVectorImpl<char> &S) {
+      if (Cur == End)
+        return false;
+      unsigned N;
+      uint64_t Shared = 0;
+      if (!First) {
+        Shared = llvm::decodeULEB128(Cur, &N);
+        Cur += N;
+      }
+      First = false;
+      uint64_t Suffix = llvm::decodeULEB128(Cur, &N);
+      Cur += N;
+      S.resize(Shared);
+      S.append(Cur, Cur + Suffix);
+      Cur += Suffix;
+      return true;
+    }
+
+  private:
+    const uint8_t *Cur;
+    const uint8_t *End;
+    bool First = true;
+  };
+
+  StringRef getPendingString(const PendingUSR &P) const {
+    return StringRef(PendingChars.data() + P.Offset, P.Size);
+  }
+
+  StringRef getFirstString(size_t Block) const {
+    const auto *Cur =
+        reinterpret_cast<const uint8_t *>(Data.data()) + BlockOffsets[Block];
+    unsigned N;
+    uint64_t Size = llvm::decodeULEB128(Cur, &N);
+    return StringRef(reinterpret_cast<const char *>(Cur + N), Size);
+  }
+
+  /// Appends \p S, which must not sort before the last appended USR.
+  void append(StringRef S, const SymbolHash &Hash) {
+    if (!Hashes.empty() && S == Last) {
+      if (Hash != Hashes.back() && OnConflict)
+        OnConflict(S, Hashes.back(), Hash);
+      return;
+    }
+
+    uint8_t Buf[16];
+    if (Hashes.size() % BlockSize == 0) {
+      BlockOffsets.push_back(Data.size());
+      Data.insert(Data.end(), Buf, Buf + llvm::encodeULEB128(S.size(), Buf));
+      Data.insert(Data.end(), S.begin(), S.end());
+    } else {
+      size_t Shared = 0;
+      size_t Max = std::min(S.size(), Last.size());
+      while (Shared < Max && S[Shared] == Last[Shared])
+        ++Shared;
+      Data.insert(Data.end(), Buf, Buf + llvm::encodeULEB128(Shared, Buf));
+      Data.insert(Data.end(), Buf,
+                  Buf + llvm::encodeULEB128(S.size() - Shared, Buf));
+      Data.insert(Data.end(), S.begin() + Shared, S.end());
+    }
+    Last = S;
+    Hashes.push_back(Hash);
+    UncompressedSize += sizeof(std::string) + S.size() + 1;
+  }
+
+  std::vector<char> Data;
+  std::vector<size_t> BlockOffsets;
+  std::vector<SymbolHash> Hashes;
+  SmallString<256> Last;
+  size_t UncompressedSize = 0;
+
+  std::vector<PendingUSR> Pending;
+  SmallVector<char, 0> PendingChars;
+};
+
+/// With -debug-usr, the USR of every symbol and the number of symbols whose
+/// hash did not match their USR.
+USRTable DebugUSRs;
+unsigned DebugUSRMismatches = 0;
+
+/// Checks that \p Hash is the hash of \p USR and records the USR. Must be
+/// called with Mutex held.
+void verifySymbolHash(const SymbolHash &Hash, StringRef USR) {
+  if (USR.empty()) {
+    llvm::errs() << "error: no USR for symbol with hash " << Hash.High << ":"
+                 << Hash.Low << "\n";
+    ++DebugUSRMismatches;
+    return;
+  }
+  if (getSymbolHash(USR) != Hash) {
+    llvm::errs() << "error: symbol hash does not match USR '" << USR << "'\n";
+    ++DebugUSRMismatches;
+  }
+  SymbolHash Known;
+  if (!DebugUSRs.lookup(USR, Known))
+    DebugUSRs.insert(USR, Hash);
+  else if (Known != Hash)
+    DebugUSRs.OnConflict(USR, Known, Hash);
+}
+
+/// Reports USRs that were seen with different hashes, and different USRs
+/// with the same hash. Returns a map from each hash to the index of its USR
+/// in DebugUSRs.
+std::vector<std::pair<SymbolHash, size_t>> checkDebugUSRs() {
+  DebugUSRs.compact();
+  std::vector<std::pair<SymbolHash, size_t>> ByHash;
+  ByHash.reserve(DebugUSRs.size());
+  for (size_t I = 0; I != DebugUSRs.size(); ++I)
+    ByHash.emplace_back(DebugUSRs.getHash(I), I);
+  std::sort(ByHash.begin(), ByHash.end());
+
+  SmallString<256> A, B;
+  for (size_t I = 1; I < ByHash.size(); ++I) {
+    if (ByHash[I - 1].first != ByHash[I].first)
+      continue;
+    llvm::errs() << "error: hash collision between USRs '"
+                 << DebugUSRs.getString(ByHash[I - 1].second, A) << "' and '"
+                 << DebugUSRs.getString(ByHash[I].second, B) << "'\n";
+    ++DebugUSRMismatches;
+  }
+  return ByHash;
+}
+
+static llvm::cl::opt<bool> Variables(
+    "variables",
+    llvm::cl::desc("Also report unused variables at namespace scope and "
+                   "unused static data members"));
+
+static llvm::cl::opt<bool> StaticInitializers(
+    "static-initializers",
+    llvm::cl::desc("Only report unused variables with dynamic initializers, "
+                   "together with the functions their initializers call"));
+
+/// Whether variable definitions and uses are collected at all.
+bool trackVariables() { return Variables || StaticInitializers; }
+
+/// Returns true for variables at namespace scope and static data members.
+bool isGlobalVariable(const VarDecl *VD) {
+  if (!VD->hasGlobalStorage() || VD->isStaticLocal())
+    return false;
+  return VD->isStaticDataMember() ||
+         VD->getDeclContext()->getRedeclContext()->isFileContext();
+}
+
+/// Returns true if initializing VD runs code at program startup.
+bool hasDynamicInitializer(const VarDecl *VD) {
+  const Expr *Init = VD->getInit();
+  if (!Init || VD->isConstexpr() || Init->isValueDependent())
+    return false;
+  ASTContext &Ctx = VD->getASTContext();
+  if (!Ctx.getLangOpts().CPlusPlus)
+    return false; // C only allows constant initializers.
+  if (Init->isConstantInitializer(Ctx, VD->getType()->isReferenceType()))
+    return false;
+  // Constructors may still be constexpr-evaluable.
+  return !VD->evaluateValue();
+}
+
+static llvm::cl::opt<bool> Types(
+    "types", llvm::cl::desc("Also report unused classes, enums, type aliases "
+                            "and enumerators"));
+
+static llvm::cl::opt<bool> Macros(
+    "macros", llvm::cl::desc("Also report macros that are never expanded or "
+                             "checked with defined() or #ifdef"));
+
+/// Returns the declaration that D was instantiated from, or D itself. Like
+/// functions, types and enumerators are tracked on their template patterns.
+const NamedDecl *getTypePattern(const NamedDecl *D) {
+  if (const auto *Spec = dyn_cast<ClassTemplateSpecializationDecl>(D))
+    return Spec->getSpecializedTemplate()->getTemplatedDecl();
+  if (const auto *RD = dyn_cast<CXXRecordDecl>(D)) {
+    if (const CXXRecordDecl *Pattern = RD->getTemplateInstantiationPattern())
+      return Pattern;
+  } else if (const auto *ED = dyn_cast<EnumDecl>(D)) {
+    if (const EnumDecl *Pattern = ED->getTemplateInstantiationPattern())
+      return Pattern;
+  } else if (const auto *ECD = dyn_cast<EnumConstantDecl>(D)) {
+    const auto *ED = cast<EnumDecl>(ECD->getDeclContext());
+    if (const EnumDecl *Pattern = ED->getTemplateInstantiationPattern())
+      for (const EnumConstantDecl *E : Pattern->enumerators())
+        if (E->getDeclName() == ECD->getDeclName())
+          return E;
+  }
+  return D;
+}
+
+/// Returns true for the types, type aliases and enumerators that -types
+/// reports.
+bool isTrackedType(const NamedDecl *D) {
+  if (D->isImplicit() || D->getParentFunctionOrMethod())
+    return false; // Injected class names and local types.
+  if (isa<TagDecl>(D) && D->getDeclName().isEmpty())
+    return false; // Tracked through their typedef or enumerators.
+  if (const auto *RD = dyn_cast<CXXRecordDecl>(D))
+    return !RD->isLambda();
+  if (const auto *TAD = dyn_cast<TypeAliasDecl>(D))
+    if (TAD->getDescribedAliasTemplate())
+      return false;
+  if (isa<TypedefNameDecl>(D)) {
+    // Typedefs in class templates are not linked to their instantiations.
+    const DeclContext *DC = D->getDeclContext();
+    if (DC->isDependentContext())
+      return false;
+    if (const auto *RD = dyn_cast<CXXRecordDecl>(DC))
+      if (RD->getTemplateInstantiationPattern())
+        return false;
+  }
+  return true;
+}
+
+/// Returns the type declaration that a TypeLoc of type T names, if any.
+const NamedDecl *getReferencedType(const Type *T) {
+  if (const auto *TT = dyn_cast<TagType>(T))
+    return TT->getDecl();
+  if (const auto *TT = dyn_cast<TypedefType>(T))
+    return TT->getDecl();
+  if (const auto *ICT = dyn_cast<InjectedClassNameType>(T))
+    return ICT->getDecl();
+#if CLANG_VERSION_MAJOR >= 14
+  if (const auto *UT = dyn_cast<UsingType>(T))
+    return getReferencedType(UT->getUnderlyingType().getTypePtr());
+#endif
+  if (const auto *TST = dyn_cast<TemplateSpecializationType>(T))
+    if (const auto *CTD = dyn_cast_or_null<ClassTemplateDecl>(
+            TST->getTemplateName().getAsTemplateDecl()))
+      return CTD->getTemplatedDecl();
+  return nullptr;
+}
+
+/// Collects the functions called while evaluating S, including constructors
+/// and the destructors of temporaries.
+template <class Vector>
+void collectCallees(const Stmt *S, Vector &Callees) {
+  if (!S)
+    return;
+  if (const auto *CE = dyn_cast<CallExpr>(S)) {
+    if (const FunctionDecl *FD = CE->getDirectCallee())
+      Callees.push_back(FD);
+  } else if (const auto *CE = dyn_cast<CXXConstructExpr>(S)) {
+    Callees.push_back(CE->getConstructor());
+  } else if (const auto *BTE = dyn_cast<CXXBindTemporaryExpr>(S)) {
+    Callees.push_back(BTE->getTemporary()->getDestructor());
+  }
+  for (const Stmt *Child : S->children())
+    collectCallees(Child, Callees);
+}
+
+/// Returns the definition of the function or variable D in this TU.
+const Decl *getDefinition(const Decl *D) {
+  if (const auto *FD = dyn_cast<FunctionDecl>(D))
+    return FD->getDefinition();
+  const auto *VD = cast<VarDecl>(D);
+  if (const VarDecl *Def = VD->getDefinition())
+    return Def;
+  return VD->getActingDefinition(); // C tentative definition
+}
+
+/// Returns the absolute path of the file of Loc without '.' and '..'
+/// components, so that a file has the same name in every translation unit
+/// however it was included. This is the real path with symlinks resolved
+/// if the file was opened.
+std::string getNormalizedFilename(SourceLocation Loc,
+                                  const SourceManager &SM) {
+  const FileEntry *File = SM.getFileEntryForID(SM.getFileID(Loc));
+  if (!File)
+    return {};
+  if (!File->tryGetRealPathName().empty())
+    return File->tryGetRealPathName().str();
+  SmallString<256> Path(SM.getFilename(Loc));
+  SM.getFileManager().makeAbsolutePath(Path);
+  llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+  return std::string(Path.str());
+}
+
+/// Returns all declarations that are not the definition D
+std::vector<DeclLoc> getDeclarations(const Decl *D, const SourceManager &SM) {
+  std::vector<DeclLoc> Decls;
+  for (const Decl *R : D->redecls()) {
+    if (R == D)
+      continue;
+    auto Begin = R->getSourceRange().getBegin();
+    Decls.emplace_back(getNormalizedFilename(Begin, SM),
+                       SM.getSpellingLineNumber(Begin));
+  }
+  return Decls;
+}
+
+/// Returns the function that F was instantiated from, or F itself.
+const FunctionDecl *getFunctionPattern(const FunctionDecl *F) {
+  if (auto *Templ = F->getInstantiatedFromMemberFunction())
+    F = Templ;
+
+  if (F->isTemplateInstantiation()) {
+    F = F->getTemplateInstantiationPattern();
+    assert(F);
+  }
+  return F;
+}
+
+/// Returns the function whose body contains Node, looking through lambdas,
+/// or null for code outside of functions like global initializers.
+const FunctionDecl *getEnclosingFunction(DynTypedNode Node, ASTContext &Ctx) {
+  for (;;) {
+    auto Parents = Ctx.getParents(Node);
+    if (Parents.empty())
+      return nullptr;
+    Node = Parents[0];
+    if (const auto *FD = Node.get<FunctionDecl>())
+      if (!isLambdaCallOperator(FD))
+        return FD;
+  }
+}
+
+/// Returns true if F is called from outside of the program's own code.
+bool isRootFunction(const FunctionDecl *F) {
+  if (F->isMain() || F->hasAttr<ConstructorAttr>() ||
+      F->hasAttr<DestructorAttr>() || F->hasAttr<UsedAttr>() ||
+      F->hasAttr<DLLExportAttr>() || isa<CXXDestructorDecl>(F))
+    return true;
+  if (const auto *VA = F->getAttr<VisibilityAttr>())
+    if (VA->getVisibility() == VisibilityAttr::Default)
+      return true;
+  return RootRegex && RootRegex->match(F->getQualifiedNameAsString());
+}
+
+/// Returns true for functions that could be given internal linkage if no
+/// other translation unit used them.
+bool canBeInternal(const Decl *D) {
+  const auto *FD = dyn_cast<FunctionDecl>(D);
+  return FD && !isa<CXXMethodDecl>(FD) && FD->isExternallyVisible() &&
+         !FD->isInlined() && !FD->isWeak();
+}
+
+/// Returns true for functions that are exported from their library but
+/// could be hidden if no other library used them. Virtual methods are left
+/// out, as vtables in other libraries can refer to them.
+bool canBeHidden(const Decl *D) {
+  const auto *FD = dyn_cast<FunctionDecl>(D);
+  if (!FD || !FD->isExternallyVisible() || FD->isInlined() || FD->isWeak() ||
+      FD->getVisibility() != DefaultVisibility)
+    return false;
+  const auto *MD = dyn_cast<CXXMethodDecl>(FD);
+  return !MD || !MD->isVirtual();
+}
+
+static llvm::cl::opt<bool> CouldBeFinal(
+    "could-be-final",
+    llvm::cl::desc("Also report polymorphic classes that are never derived "
+                   "from and virtual methods that are never overridden"));
+
+/// Returns true for virtual methods that could be final.
+bool canBeFinal(const CXXMethodDecl *MD) {
+  return MD->isVirtual() && !MD->isImplicit() &&
+#if CLANG_VERSION_MAJOR >= 18
+         !MD->isPureVirtual() &&
+#else
+         !MD->isPure() &&
+#endif
+         !isa<CXXDestructorDecl>(MD) && !MD->hasAttr<FinalAttr>() &&
+         !MD->getParent()->hasAttr<FinalAttr>();
+}
+
+/// Returns the function definitions in headers that -header-functions
+/// reports. Every TU that includes the header parses them; constexpr
+/// functions have to stay visible for constant evaluation, and the uses of
+/// virtual methods and destructors are not seen.
+bool isHeaderFunctionCandidate(const FunctionDecl *F) {
+  if (F->isImplicit() || F->isDefaulted() || F->isConstexpr() ||
+      F->getParentFunctionOrMethod() || isa<CXXDestructorDecl>(F))
+    return false;
+  if (const auto *MD = dyn_cast<CXXMethodDecl>(F))
+    if (MD->isVirtual() || MD->getParent()->isLambda())
+      return false;
+  return F->isInlined() || F->isTemplated();
+}
+
+static llvm::cl::opt<bool> SortBySize(
+    "sort-by-size",
+    llvm::cl::desc("Annotate unused functions with the number of AST nodes in "
+                   "their body and report the largest ones first"));
+
+/// Returns the number of statements and expressions in S, as an estimate of
+/// the code size of a function body.
+unsigned countStmts(const Stmt *S) {
+  unsigned Count = 0;
+  SmallVector<const Stmt *, 32> Worklist;
+  if (S)
+    Worklist.push_back(S);
+  while (!Worklist.empty()) {
+    const Stmt *Cur = Worklist.pop_back_val();
+    ++Count;
+    for (const Stmt *Child : Cur->children())
+      if (Child)
+        Worklist.push_back(Child);
+  }
+  return Count;
 }
 
-/// Returns all declarations that are not the definition of F
-std::vector<DeclLoc> getDeclarations(const FunctionDecl *F,
-                                     const SourceManager &SM) {
-  std::vector<DeclLoc> Decls;
-  for (const FunctionDecl *R : F->redecls()) {
-    if (R->doesThisDeclarationHaveABody())
-      continue;
-    auto Begin = R->getSourceRange().getBegin();
-    Decls.emplace_back(SM.getFilename(Begin).str(), SM.getSpellingLineNumber(Begin));
-    SM.getFileManager().makeAbsolutePath(Decls.back().Filename);
-  }
-  return Decls;
+/// Returns the number of lines that R spans.
+unsigned getLineCount(SourceRange R, const SourceManager &SM) {
+  unsigned Begin = SM.getSpellingLineNumber(R.getBegin());
+  unsigned End = SM.getSpellingLineNumber(R.getEnd());
+  return End >= Begin ? End - Begin + 1 : 1;
 }
 
 class FunctionDeclMatchHandler : public MatchFinder::MatchCallback {
 public:
   void finalize(const SourceManager &SM) {
-    std::unique_lock<std::mutex> LockGuard(Mutex);
+    mergeSummary(SM);
 
-    std::vector<const FunctionDecl *> UnusedDefs;
-
-    std::set_difference(Defs.begin(), Defs.end(), Uses.begin(), Uses.end(),
-                        std::back_inserter(UnusedDefs));
+    // Everything this TU allocated from the arena has been merged into
+    // AllDecls or is dead now.
+    ArenaVector<const Decl *>().swap(Defs);
+    ArenaVector<const Decl *>().swap(Uses);
+    ArenaVector<const NamedDecl *>().swap(TypeDefs);
+    ArenaVector<const NamedDecl *>().swap(TypeUses);
+    ArenaVector<MacroRef>().swap(MacroDefs);
+    ArenaVector<MacroRef>().swap(MacroUses);
+    ArenaVector<CallEdge>().swap(CallEdges);
+    ArenaVector<Reference>().swap(References);
+    ArenaVector<const NamedDecl *>().swap(FinalCandidates);
+    ArenaVector<const NamedDecl *>().swap(Overridden);
+    ArenaVector<const FunctionDecl *>().swap(VirtualMethods);
+    ArenaVector<CallEdge>().swap(FamilyEdges);
+    ArenaVector<const FunctionDecl *>().swap(FamilyRoots);
+    ArenaVector<const FunctionDecl *>().swap(HeaderFunctionDefs);
+    ArenaVector<FileID>().swap(IncludedFiles);
+    ArenaVector<const Decl *>().swap(ExportedDecls);
+    ArenaVector<IndexRef>().swap(IndexRefs);
+    Mangler.reset();
+    resetSummaryArena();
+  }
 
-    for (auto *F : UnusedDefs) {
-      F = F->getDefinition();
-      assert(F);
-      std::string USR;
-      if (!getUSRForDecl(F, USR))
-        continue;
-      // llvm::errs() << "UnusedDefs: " << USR << "\n";
-      auto it_inserted = AllDecls.emplace(std::move(USR), DefInfo{F, 0});
-      if (!it_inserted.second) {
-        it_inserted.first->second.Definition = F;
-      }
-      it_inserted.first->second.Name = F->getQualifiedNameAsString();
+  void mergeSummary(const SourceManager &SM) {
+    // Defs and Uses are appended to while matching; sort them once here
+    // instead of paying for a node allocation per insert.
+    sort_unique(Defs);
+    sort_unique(Uses);
 
-      auto Begin = F->getSourceRange().getBegin();
-      it_inserted.first->second.Filename = SM.getFilename(Begin);
-      it_inserted.first->second.Line = SM.getSpellingLineNumber(Begin);
+    ArenaVector<const Decl *> UnusedDefs;
+    uint32_t TU = NextTUId++;
+    sort_unique(ExportedDecls);
+    auto IsExported = [&](const Decl *D) {
+      return std::binary_search(ExportedDecls.begin(), ExportedDecls.end(), D);
+    };
 
-      it_inserted.first->second.Declarations = getDeclarations(F, SM);
+    if (Reachability || CouldBeStatic || CouldBeHidden || CallSites ||
+        !Profile.empty()) {
+      // Every function definition is a node of the call graph, whether
+      // this TU uses it or not. -could-be-static, -could-be-hidden,
+      // -call-sites and -profile need to know about the definitions that
+      // are used here.
+      for (const Decl *D : Defs)
+        if ((Reachability && isa<FunctionDecl>(D)) ||
+            (CallSites && isa<FunctionDecl>(D)) ||
+            (!Profile.empty() && isa<FunctionDecl>(D)) ||
+            (CouldBeStatic && canBeInternal(D)) ||
+            (CouldBeHidden && canBeHidden(D)) ||
+            !std::binary_search(Uses.begin(), Uses.end(), D))
+          UnusedDefs.push_back(D);
+    } else {
+      std::set_difference(Defs.begin(), Defs.end(), Uses.begin(), Uses.end(),
+                          std::back_inserter(UnusedDefs));
     }
 
     // Weak functions are not the definitive definition. Remove it from
     // Defs before checking which uses we need to consider in other TUs,
     // so the functions overwritting the weak definition here are marked
     // as used.
-    discard_if(Defs, [](const FunctionDecl *FD) { return FD->isWeak(); });
+    discard_if(Defs, [](const Decl *D) { return D->isWeak(); });
 
-    std::vector<const FunctionDecl *> ExternalUses;
+    ArenaVector<const Decl *> ExternalUses;
 
     std::set_difference(Uses.begin(), Uses.end(), Defs.begin(), Defs.end(),
                         std::back_inserter(ExternalUses));
 
-    for (auto *F : ExternalUses) {
-      // llvm::errs() << "ExternalUses: " << F->getNameAsString() << "\n";
-      std::string USR;
-      if (!getUSRForDecl(F, USR))
+    // Build the summary of this TU outside of the lock; only the merge into
+    // AllDecls is serialized.
+    // Types are mostly defined in headers, so many TUs see the same
+    // definition. Each TU records the definitions it doesn't use, which
+    // counts the TUs that parse a dead type, and all types it uses.
+    sort_unique(TypeDefs);
+    sort_unique(TypeUses);
+
+    ArenaVector<const NamedDecl *> UnusedTypes;
+
+    std::set_difference(TypeDefs.begin(), TypeDefs.end(), TypeUses.begin(),
+                        TypeUses.end(), std::back_inserter(UnusedTypes));
+
+    // Macros are handled like types.
+    sort_unique(MacroDefs);
+    sort_unique(MacroUses);
+
+    ArenaVector<MacroRef> UnusedMacros;
+
+    std::set_difference(MacroDefs.begin(), MacroDefs.end(), MacroUses.begin(),
+                        MacroUses.end(), std::back_inserter(UnusedMacros));
+
+    // Include guards are only checked before they are defined.
+    discard_if(UnusedMacros, [](const MacroRef &M) {
+      return M.first->isUsedForHeaderGuard();
+    });
+
+    // Reference counts for -call-sites. The instantiations of a template
+    // share the locations of its references, so count distinct locations.
+    sort_unique(References);
+    struct ReferenceCount {
+      const Decl *Callee;
+      uint32_t Count;
+      bool InHeader;
+      const FunctionDecl *Caller;
+    };
+    ArenaVector<ReferenceCount> Counts;
+    for (const Reference &R : References) {
+      if (Counts.empty() || Counts.back().Callee != std::get<0>(R))
+        Counts.push_back({std::get<0>(R), 0, false, nullptr});
+      if (SM.isInMainFile(std::get<1>(R))) {
+        ++Counts.back().Count;
+        Counts.back().Caller = std::get<2>(R);
+      } else
+        Counts.back().InHeader = true;
+    }
+    auto AddReferences = [&](const Decl *D, DefInfo &I) {
+      auto It = std::lower_bound(
+          Counts.begin(), Counts.end(), D,
+          [](const ReferenceCount &C, const Decl *D) { return C.Callee < D; });
+      if (It == Counts.end() || It->Callee != D)
+        return;
+      I.References = It->Count;
+      I.HeaderReferences = It->InHeader;
+      if (It->Count == 1 && It->Caller)
+        I.Caller = It->Caller->getQualifiedNameAsString();
+    };
+
+    // Class hierarchy. Like types, classes and their methods are mostly
+    // declared in headers; each TU records the candidates that it does not
+    // derive from or override, and everything that it derives or overrides.
+    sort_unique(FinalCandidates);
+    sort_unique(Overridden);
+
+    ArenaVector<const NamedDecl *> FinalDecls;
+
+    std::set_difference(FinalCandidates.begin(), FinalCandidates.end(),
+                        Overridden.begin(), Overridden.end(),
+                        std::back_inserter(FinalDecls));
+
+    ArenaVector<std::pair<SymbolHash, DefInfo>> Summary;
+    Summary.reserve(FinalDecls.size() + Overridden.size() +
+                    UnusedDefs.size() + ExternalUses.size() +
+                    UnusedTypes.size() + TypeUses.size() +
+                    UnusedMacros.size() + MacroUses.size() +
+                    HeaderFunctionDefs.size());
+
+    ArenaVector<StringRef> SummaryUSRs; // Only with -debug-usr.
+    llvm::StringSaver Saver(SummaryArena);
+    auto SaveUSR = [&](const Decl *D) {
+      SmallString<128> USR;
+      if (index::generateUSRForDecl(D, USR))
+        USR.clear();
+      SummaryUSRs.push_back(Saver.save(USR.str()));
+    };
+
+    for (const Decl *D : UnusedDefs) {
+      DefInfo I;
+      I.DefTU = TU;
+      I.DefLibrary = Library;
+      I.DefCategory = Category;
+      I.Exported = IsExported(D);
+      if (std::binary_search(Uses.begin(), Uses.end(), D)) {
+        I.Uses = 1;
+        I.UserTUs.add(TU);
+        I.UserLibraries.add(Library);
+        I.UserCategories = 1u << Category;
+        I.UserComponents = ComponentBit;
+      }
+      I.CanBeInternal = canBeInternal(D);
+      I.CanBeHidden = canBeHidden(D);
+      AddReferences(D, I);
+
+      D = getDefinition(D);
+      assert(D);
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      I.Defined = true;
+      I.Name = cast<NamedDecl>(D)->getQualifiedNameAsString();
+      if (SortBySize)
+        if (const auto *FD = dyn_cast<FunctionDecl>(D))
+          I.Size = countStmts(FD->getBody());
+      if (!ScanPaths.empty() && !D->isTemplated() &&
+          (isa<FunctionDecl>(D) || isa<VarDecl>(D)))
+        I.SymbolName = getMangledName(cast<NamedDecl>(D));
+      // Templates have a profile record per instantiation.
+      if (!Profile.empty() && isa<FunctionDecl>(D) && !D->isTemplated())
+        I.NeverExecuted = Profile.lookup(getMangledName(cast<NamedDecl>(D))) ==
+                          ProfileCounts::NeverExecuted;
+      if (const auto *VD = dyn_cast<VarDecl>(D)) {
+        I.Kind = SymbolKind::Variable;
+        I.DynamicInit = hasDynamicInitializer(VD);
+        if (I.DynamicInit && StaticInitializers) {
+          ArenaVector<const FunctionDecl *> Callees;
+          collectCallees(VD->getInit(), Callees);
+          sort_unique(Callees);
+          for (const FunctionDecl *Callee : Callees)
+            I.InitCallees.push_back(Callee->getQualifiedNameAsString());
+          sort_unique(I.InitCallees);
+        }
+      }
+
+      auto Begin = D->getSourceRange().getBegin();
+      I.Filename = getNormalizedFilename(Begin, SM);
+      I.Line = SM.getSpellingLineNumber(Begin);
+      if (!ComponentMapFile.empty())
+        I.DefComponent = Components.getComponent(I.Filename);
+
+      I.Declarations = getDeclarations(D, SM);
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    for (const Decl *D : ExternalUses) {
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      DefInfo I;
+      I.Uses = 1;
+      I.UserTUs.add(TU);
+      I.UserLibraries.add(Library);
+      I.UserCategories = 1u << Category;
+      I.UserComponents = ComponentBit;
+      I.Exported = IsExported(D);
+      AddReferences(D, I);
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    for (const NamedDecl *D : UnusedTypes) {
+      if (const auto *TD = dyn_cast<TagDecl>(D))
+        D = TD->getDefinition();
+      assert(D);
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      DefInfo I;
+      I.Defined = true;
+      I.Kind = isa<EnumConstantDecl>(D) ? SymbolKind::Enumerator
+                                        : SymbolKind::Type;
+      I.IncludingTUs = 1;
+      I.Name = D->getQualifiedNameAsString();
+
+      auto Begin = D->getSourceRange().getBegin();
+      I.Filename = getNormalizedFilename(Begin, SM);
+      I.Line = SM.getSpellingLineNumber(Begin);
+      I.Lines = getLineCount(D->getSourceRange(), SM);
+
+      I.Declarations = getDeclarations(D, SM);
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    for (const NamedDecl *D : TypeUses) {
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      DefInfo I;
+      I.Uses = 1;
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    for (const NamedDecl *D : FinalDecls) {
+      if (const auto *TD = dyn_cast<TagDecl>(D))
+        D = TD->getDefinition();
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      DefInfo I;
+      I.Kind = isa<CXXMethodDecl>(D) ? SymbolKind::Function : SymbolKind::Type;
+      I.CanBeFinal = true;
+      I.Name = D->getQualifiedNameAsString();
+      auto Loc = D->getLocation();
+      I.Filename = getNormalizedFilename(Loc, SM);
+      I.Line = SM.getSpellingLineNumber(Loc);
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    for (const NamedDecl *D : Overridden) {
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      DefInfo I;
+      I.Overridden = true;
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    // Header functions only carry their name here; the uses are recorded
+    // with the other external uses, as the definition is not in Defs.
+    sort_unique(HeaderFunctionDefs);
+    for (const FunctionDecl *D : HeaderFunctionDefs) {
+      SymbolHash Hash;
+      if (!getSymbolHash(D, Hash))
+        continue;
+      DefInfo I;
+      I.HeaderFunction = true;
+      I.Name = D->getQualifiedNameAsString();
+      auto Begin = D->getSourceRange().getBegin();
+      I.Filename = getNormalizedFilename(Begin, SM);
+      I.Line = SM.getSpellingLineNumber(Begin);
+      I.Lines = getLineCount(D->getSourceRange(), SM);
+      if (DebugUSR)
+        SaveUSR(D);
+      Summary.emplace_back(Hash, std::move(I));
+    }
+
+    // A header without include guard may be entered more than once.
+    ArenaVector<StringRef> IncludedNames;
+    for (FileID FID : IncludedFiles)
+      IncludedNames.push_back(Saver.save(
+          getNormalizedFilename(SM.getLocForStartOfFile(FID), SM)));
+    sort_unique(IncludedNames);
+
+    // Macros are identified by the USR of their definition, which contains
+    // its file and offset.
+    for (const MacroRef &M : UnusedMacros) {
+      SmallString<128> USR;
+      auto Loc = M.first->getDefinitionLoc();
+      if (index::generateUSRForMacro(M.second->getName(), Loc, SM, USR))
         continue;
-      // llvm::errs() << "ExternalUses: " << USR << "\n";
-      auto it_inserted = AllDecls.emplace(std::move(USR), DefInfo{nullptr, 1});
-      if (!it_inserted.second) {
-        it_inserted.first->second.Uses++;
+      DefInfo I;
+      I.Defined = true;
+      I.Kind = SymbolKind::Macro;
+      I.IncludingTUs = 1;
+      I.Name = M.second->getName().str();
+      I.Filename = getNormalizedFilename(Loc, SM);
+      I.Line = SM.getSpellingLineNumber(Loc);
+      I.Lines = getLineCount({Loc, M.first->getDefinitionEndLoc()}, SM);
+      if (DebugUSR)
+        SummaryUSRs.push_back(Saver.save(USR.str()));
+      Summary.emplace_back(getSymbolHash(USR.str()), std::move(I));
+    }
+
+    for (const MacroRef &M : MacroUses) {
+      SmallString<128> USR;
+      if (index::generateUSRForMacro(M.second->getName(),
+                                     M.first->getDefinitionLoc(), SM, USR))
+        continue;
+      DefInfo I;
+      I.Uses = 1;
+      if (DebugUSR)
+        SummaryUSRs.push_back(Saver.save(USR.str()));
+      Summary.emplace_back(getSymbolHash(USR.str()), std::move(I));
+    }
+
+    // Call graph edges; a null caller makes the callee a root.
+    sort_unique(CallEdges);
+    llvm::DenseMap<const Decl *, SymbolHash> EdgeHashes;
+    auto GetEdgeHash = [&](const Decl *D, SymbolHash &Hash) {
+      auto Ins = EdgeHashes.try_emplace(D);
+      if (Ins.second && !getSymbolHash(D, Ins.first->second))
+        Ins.first->second = SymbolHash(); // Marks failure.
+      Hash = Ins.first->second;
+      return Hash != SymbolHash();
+    };
+    ArenaVector<std::pair<SymbolHash, SymbolHash>> Edges;
+    ArenaVector<SymbolHash> RootHashes;
+    for (const CallEdge &E : CallEdges) {
+      SymbolHash Caller, Callee;
+      if (!GetEdgeHash(E.second, Callee))
+        continue;
+      if (!E.first)
+        RootHashes.push_back(Callee);
+      else if (GetEdgeHash(E.first, Caller))
+        Edges.emplace_back(Caller, Callee);
+    }
+
+    // Virtual method families. A call through any member uses the family,
+    // so record all virtual methods that this TU references.
+    struct FamilyMember {
+      SymbolHash Hash;
+      StringRef Name;
+      StringRef Filename;
+      unsigned Line;
+    };
+    ArenaVector<FamilyMember> FamilyMembers;
+    ArenaVector<std::pair<SymbolHash, SymbolHash>> FamilyEdgeHashes;
+    ArenaVector<SymbolHash> UsedMethods;
+    if (VirtualFamilies) {
+      sort_unique(VirtualMethods);
+      sort_unique(FamilyEdges);
+      for (const FunctionDecl *M : VirtualMethods) {
+        SymbolHash Hash;
+        if (!GetEdgeHash(M, Hash))
+          continue;
+        auto Loc = M->getLocation();
+        FamilyMembers.push_back(
+            {Hash, Saver.save(M->getQualifiedNameAsString()),
+             Saver.save(SM.getFilename(Loc)), SM.getSpellingLineNumber(Loc)});
+      }
+      for (const CallEdge &E : FamilyEdges) {
+        SymbolHash Overrider, Base;
+        if (GetEdgeHash(E.first, Overrider) && GetEdgeHash(E.second, Base))
+          FamilyEdgeHashes.emplace_back(Overrider, Base);
+      }
+      for (const Decl *D : Uses) {
+        const auto *MD = dyn_cast<CXXMethodDecl>(D);
+        SymbolHash Hash;
+        if (MD && MD->isVirtual() && GetEdgeHash(MD, Hash))
+          UsedMethods.push_back(Hash);
+      }
+      for (const FunctionDecl *M : FamilyRoots) {
+        SymbolHash Hash;
+        if (GetEdgeHash(M, Hash))
+          UsedMethods.push_back(Hash);
+      }
+    }
+
+    // Reverse references. Instantiations share the locations of their
+    // pattern's uses.
+    struct IndexEntry {
+      SymbolHash Target;
+      StringRef Name;
+      StringRef User;
+      StringRef Filename;
+      unsigned Line;
+    };
+    ArenaVector<IndexEntry> IndexEntries;
+    if (!IndexFile.empty()) {
+      sort_unique(IndexRefs);
+      llvm::DenseMap<const Decl *, StringRef> Names;
+      auto GetName = [&](const Decl *D) {
+        auto Ins = Names.try_emplace(D);
+        if (Ins.second)
+          Ins.first->second =
+              Saver.save(cast<NamedDecl>(D)->getQualifiedNameAsString());
+        return Ins.first->second;
+      };
+      llvm::DenseMap<FileID, StringRef> Filenames;
+      auto GetFilename = [&](SourceLocation Loc) {
+        auto Ins = Filenames.try_emplace(SM.getFileID(Loc));
+        if (Ins.second)
+          Ins.first->second = Saver.save(getNormalizedFilename(Loc, SM));
+        return Ins.first->second;
+      };
+      StringRef MainFile =
+          GetFilename(SM.getLocForStartOfFile(SM.getMainFileID()));
+      for (const IndexRef &R : IndexRefs) {
+        SymbolHash Hash;
+        if (!GetEdgeHash(std::get<0>(R), Hash))
+          continue;
+        auto Loc = SM.getFileLoc(std::get<1>(R));
+        IndexEntries.push_back(
+            {Hash, GetName(std::get<0>(R)),
+             std::get<2>(R) ? GetName(std::get<2>(R)) : MainFile,
+             GetFilename(Loc), SM.getSpellingLineNumber(Loc)});
+      }
+    }
+
+    std::unique_lock<std::mutex> LockGuard(Mutex);
+
+    for (const IndexEntry &E : IndexEntries)
+      Index.add(Index.getTarget(E.Target, E.Name), Index.getString(E.User),
+                Index.getString(E.Filename), E.Line);
+
+    for (StringRef Name : IncludedNames)
+      ++IncludeFanOut[Name];
+    if (HeaderFunctions) {
+      if (TUFiles.size() <= TU)
+        TUFiles.resize(TU + 1);
+      auto MainLoc = SM.getLocForStartOfFile(SM.getMainFileID());
+      TUFiles[TU] = getNormalizedFilename(MainLoc, SM);
+    }
+
+    for (const FamilyMember &M : FamilyMembers) {
+      auto &Member = Families.getMember(Families.getNode(M.Hash));
+      if (Member.Name.empty()) {
+        Member.Name = M.Name.str();
+        Member.Filename = M.Filename.str();
+        Member.Line = M.Line;
       }
     }
+    for (const auto &E : FamilyEdgeHashes) {
+      uint32_t Overrider = Families.getNode(E.first);
+      Families.getMember(Overrider).Overrides = true;
+      Families.unite(Overrider, Families.getNode(E.second));
+    }
+    for (const SymbolHash &Hash : UsedMethods)
+      Families.getMember(Families.getNode(Hash)).Used = true;
+
+    for (const SymbolHash &Hash : RootHashes)
+      Calls.addEdge(CallGraph::Root, Calls.getNode(Hash));
+    for (const auto &E : Edges)
+      Calls.addEdge(Calls.getNode(E.first), Calls.getNode(E.second));
+
+    for (size_t I = 0; I != SummaryUSRs.size(); ++I)
+      verifySymbolHash(Summary[I].first, SummaryUSRs[I]);
+    for (auto &KV : Summary)
+      AllDecls.add(KV.first, std::move(KV.second));
   }
 
-  void handleUse(const ValueDecl *D, const SourceManager *SM) {
+  /// Records a use of D from the body of Caller, which is null for uses
+  /// outside of functions. Only -reachability, -call-sites and -index-file
+  /// look at the caller.
+  void handleUse(const ValueDecl *D, const SourceManager *SM,
+                 const FunctionDecl *Caller = nullptr,
+                 SourceLocation Loc = SourceLocation()) {
+    if (const auto *VD = dyn_cast<VarDecl>(D)) {
+      handleVarUse(VD, SM, Caller, Loc);
+      return;
+    }
     auto *FD = dyn_cast<FunctionDecl>(D);
     if (!FD)
       return;
@@ -145,27 +3639,243 @@ public:
     //llvm::errs() << " USR:" << USR;
     llvm::errs() << "\n";
 #endif
-    Uses.insert(FD->getCanonicalDecl());
+    Uses.push_back(FD->getCanonicalDecl());
+    if (Caller)
+      Caller = getFunctionPattern(Caller)->getCanonicalDecl();
+    // System functions are not nodes of the call graph, and code outside of
+    // the project may call them, so their callees are roots; this covers
+    // lambdas passed to std::sort and operators called by std templates.
+    if (Reachability)
+      CallEdges.emplace_back(
+          Caller && SM->isInSystemHeader(Caller->getLocation()) ? nullptr
+                                                                : Caller,
+          FD->getCanonicalDecl());
+    if (CallSites && Loc.isValid())
+      References.emplace_back(FD->getCanonicalDecl(), Loc, Caller);
+    if (!IndexFile.empty() && Loc.isValid())
+      IndexRefs.emplace_back(FD->getCanonicalDecl(), Loc, Caller);
+  }
+
+  /// Adds the edges that the call graph needs for a function definition
+  /// beyond the uses in its body.
+  void handleGraphNode(const FunctionDecl *F, const SourceManager *SM) {
+    if (isRootFunction(F))
+      CallEdges.emplace_back(nullptr, F->getCanonicalDecl());
+    // A call of a virtual method can reach every overrider.
+    if (const auto *MD = dyn_cast<CXXMethodDecl>(F))
+      for (const CXXMethodDecl *O : MD->overridden_methods()) {
+        // Code outside of the project may call methods of system classes.
+        if (SM->isInSystemHeader(O->getLocation()))
+          CallEdges.emplace_back(nullptr, F->getCanonicalDecl());
+        else
+          CallEdges.emplace_back(getFunctionPattern(O)->getCanonicalDecl(),
+                                 F->getCanonicalDecl());
+      }
+  }
+
+  /// Returns the caller of a use for -reachability, -call-sites and
+  /// -index-file.
+  template <class NodeT>
+  const FunctionDecl *getCaller(const NodeT &Node, ASTContext &Ctx) {
+    if (!Reachability && !CallSites && IndexFile.empty())
+      return nullptr;
+    return getEnclosingFunction(DynTypedNode::create(Node), Ctx);
+  }
+
+  /// Returns true if D is in the symbol tables of -exported-symbols.
+  bool isExported(const NamedDecl *D) {
+    if (Exports.empty() || D->isTemplated() || !D->isExternallyVisible())
+      return false;
+    return Exports.contains(getMangledName(D));
+  }
+
+  /// Returns the symbol name of a function or variable that is not a
+  /// template, or an empty string.
+  std::string getMangledName(const NamedDecl *D) {
+    if (!Mangler)
+      Mangler.reset(D->getASTContext().createMangleContext());
+    if (!Mangler->shouldMangleDeclName(D))
+      return D->getIdentifier() ? D->getName().str() : std::string();
+    std::string Name;
+    llvm::raw_string_ostream OS(Name);
+    if (const auto *CD = dyn_cast<CXXConstructorDecl>(D))
+      Mangler->mangleName(GlobalDecl(CD, Ctor_Complete), OS);
+    else if (const auto *DD = dyn_cast<CXXDestructorDecl>(D))
+      Mangler->mangleName(GlobalDecl(DD, Dtor_Complete), OS);
+    else if (const auto *FD = dyn_cast<FunctionDecl>(D))
+      Mangler->mangleName(GlobalDecl(FD), OS);
+    else
+      Mangler->mangleName(GlobalDecl(cast<VarDecl>(D)), OS);
+    return OS.str();
+  }
+
+  /// Exported symbols are used from outside of the project; with
+  /// -reachability, exported functions are roots.
+  void handleExport(const ValueDecl *D, const SourceManager *SM) {
+    size_t NumUses = Uses.size();
+    handleUse(D, SM);
+    if (Uses.size() != NumUses)
+      ExportedDecls.push_back(Uses.back());
+  }
+
+  void handleVarUse(const VarDecl *VD, const SourceManager *SM,
+                    const FunctionDecl *Caller = nullptr,
+                    SourceLocation Loc = SourceLocation()) {
+    if (!trackVariables() || !isGlobalVariable(VD))
+      return;
+    if (SM->isInSystemHeader(VD->getLocation()))
+      return;
+    if (auto *Pattern = VD->getTemplateInstantiationPattern())
+      VD = Pattern;
+    Uses.push_back(VD->getCanonicalDecl());
+    if (!IndexFile.empty() && Loc.isValid())
+      IndexRefs.emplace_back(
+          VD->getCanonicalDecl(), Loc,
+          Caller ? getFunctionPattern(Caller)->getCanonicalDecl() : nullptr);
+  }
+
+  void handleClassDef(const CXXRecordDecl *RD, const SourceManager *SM) {
+    if (SM->isInSystemHeader(RD->getLocation()))
+      return;
+
+    if (VirtualFamilies)
+      handleVirtualMethods(RD, SM);
+    if (!CouldBeFinal)
+      return;
+
+    // Instantiations have the bases and overrides that are dependent in
+    // their pattern; the pattern itself is matched on its own.
+    for (const CXXBaseSpecifier &B : RD->bases()) {
+      const NamedDecl *Base = B.getType()->getAsCXXRecordDecl();
+      if (!Base)
+        if (const auto *TST =
+                B.getType()->getAs<TemplateSpecializationType>())
+          if (const auto *CTD = dyn_cast_or_null<ClassTemplateDecl>(
+                  TST->getTemplateName().getAsTemplateDecl()))
+            Base = CTD->getTemplatedDecl();
+      if (Base)
+        Overridden.push_back(
+            cast<NamedDecl>(getTypePattern(Base)->getCanonicalDecl()));
+    }
+    for (const CXXMethodDecl *MD : RD->methods())
+      for (const CXXMethodDecl *O : MD->overridden_methods())
+        Overridden.push_back(getFunctionPattern(O)->getCanonicalDecl());
+
+    if (getTypePattern(RD) != RD || !isTrackedType(RD))
+      return;
+    if (RD->isPolymorphic() && !RD->hasAttr<FinalAttr>())
+      FinalCandidates.push_back(RD->getCanonicalDecl());
+    for (const CXXMethodDecl *MD : RD->methods())
+      if (canBeFinal(MD))
+        FinalCandidates.push_back(MD->getCanonicalDecl());
+  }
+
+  void handleVirtualMethods(const CXXRecordDecl *RD, const SourceManager *SM) {
+    for (const CXXMethodDecl *MD : RD->methods()) {
+      if (!MD->isVirtual() || MD->isImplicit() || isa<CXXDestructorDecl>(MD))
+        continue;
+      const FunctionDecl *M = getFunctionPattern(MD)->getCanonicalDecl();
+      VirtualMethods.push_back(M);
+      for (const CXXMethodDecl *O : MD->overridden_methods()) {
+        // Code outside of the project may call methods of system classes.
+        if (SM->isInSystemHeader(O->getLocation()))
+          FamilyRoots.push_back(M);
+        else
+          FamilyEdges.emplace_back(M,
+                                   getFunctionPattern(O)->getCanonicalDecl());
+      }
+    }
+  }
+
+  void handleTypeDef(const NamedDecl *D, const SourceManager *SM) {
+    // Instantiations and specializations are recorded on their pattern.
+    if (getTypePattern(D) != D || !isTrackedType(D))
+      return;
+    if (SM->isInSystemHeader(D->getLocation()))
+      return;
+    TypeDefs.push_back(cast<NamedDecl>(D->getCanonicalDecl()));
+  }
+
+  void handleTypeUse(const NamedDecl *D, SourceLocation Loc,
+                     const SourceManager *SM) {
+    if (!Types || SM->isInSystemHeader(D->getLocation()))
+      return;
+    D = getTypePattern(D);
+    if (!isTrackedType(D))
+      return;
+
+    // References from within the definition itself don't count. As the
+    // pattern's range also covers its instantiations, this includes them.
+    const Decl *Scope = D;
+    if (const auto *ECD = dyn_cast<EnumConstantDecl>(D)) {
+      Scope = cast<EnumDecl>(ECD->getDeclContext());
+      handleTypeUse(cast<EnumDecl>(Scope), Loc, SM);
+    }
+    if (const auto *TD = dyn_cast<TagDecl>(Scope))
+      if (const TagDecl *Def = TD->getDefinition())
+        if (SM->isPointWithin(Loc, Def->getBeginLoc(), Def->getEndLoc()))
+          return;
+
+    TypeUses.push_back(cast<NamedDecl>(D->getCanonicalDecl()));
+  }
+
+  /// Records the headers of the project that this TU includes, for
+  /// -header-functions and -header-waste.
+  void handleFileEntered(SourceLocation Loc, SrcMgr::CharacteristicKind Kind,
+                         const SourceManager &SM) {
+    if ((!HeaderFunctions && !HeaderWaste) || Kind != SrcMgr::C_User)
+      return;
+    FileID FID = SM.getFileID(Loc);
+    // The predefines and command line buffers have no file.
+    if (FID == SM.getMainFileID() || !SM.getFileEntryForID(FID))
+      return;
+    IncludedFiles.push_back(FID);
+  }
+
+  void handleMacroDef(const Token &MacroNameTok, const MacroInfo *MI,
+                      const SourceManager &SM) {
+    if (!Macros || MI->isBuiltinMacro() || !isTrackedMacro(MI, SM))
+      return;
+    MacroDefs.emplace_back(MI, MacroNameTok.getIdentifierInfo());
+  }
+
+  void handleMacroUse(const Token &MacroNameTok, const MacroDefinition &MD,
+                      const SourceManager &SM) {
+    const MacroInfo *MI = MD.getMacroInfo();
+    if (!Macros || !MI || !isTrackedMacro(MI, SM))
+      return;
+    MacroUses.emplace_back(MI, MacroNameTok.getIdentifierInfo());
+  }
+
+  static bool isTrackedMacro(const MacroInfo *MI, const SourceManager &SM) {
+    auto Loc = MI->getDefinitionLoc();
+    return Loc.isValid() && !SM.isInSystemHeader(Loc) &&
+           !SM.isWrittenInBuiltinFile(Loc) &&
+           !SM.isWrittenInCommandLineFile(Loc);
   }
   void run(const MatchFinder::MatchResult &Result) override {
     if (const auto *F = Result.Nodes.getNodeAs<FunctionDecl>("fnDecl")) {
       if (!F->hasBody())
         return; // Ignore '= delete' and '= default' definitions.
 
-      if (auto *Templ = F->getInstantiatedFromMemberFunction())
-        F = Templ;
+      // Instantiations are exported on their own; they export the pattern.
+      if (isExported(F))
+        handleExport(F, Result.SourceManager);
 
-      if (F->isTemplateInstantiation()) {
-        F = F->getTemplateInstantiationPattern();
-        assert(F);
-      }
+      F = getFunctionPattern(F);
 
       auto Begin = F->getSourceRange().getBegin();
       if (Result.SourceManager->isInSystemHeader(Begin))
         return;
 
-      if (!Result.SourceManager->isWrittenInMainFile(Begin))
+      if (Reachability)
+        handleGraphNode(F, Result.SourceManager);
+
+      if (!Result.SourceManager->isWrittenInMainFile(Begin)) {
+        if ((HeaderFunctions || HeaderWaste) && isHeaderFunctionCandidate(F))
+          HeaderFunctionDefs.push_back(F);
         return;
+      }
 
       auto *MD = dyn_cast<CXXMethodDecl>(F);
       if (MD) {
@@ -188,25 +3898,167 @@ public:
       F->printName(llvm::errs());
       llvm::errs() << " USR:" << USR << "\n";
 #endif
-      Defs.insert(F->getCanonicalDecl());
+      Defs.push_back(F->getCanonicalDecl());
 
       // __attribute__((constructor())) are always used
       if (F->hasAttr<ConstructorAttr>())
         handleUse(F, Result.SourceManager);
 
+    } else if (const auto *V = Result.Nodes.getNodeAs<VarDecl>("varDecl")) {
+      if (!isGlobalVariable(V))
+        return;
+
+      if (isExported(V))
+        handleExport(V, Result.SourceManager);
+
+      // Definitions of static data members of class templates and of
+      // variable templates are attributed to their pattern.
+      if (auto *Pattern = V->getTemplateInstantiationPattern())
+        V = Pattern;
+
+      auto Begin = V->getSourceRange().getBegin();
+      if (Result.SourceManager->isInSystemHeader(Begin))
+        return;
+
+      if (!Result.SourceManager->isWrittenInMainFile(Begin))
+        return;
+
+      Defs.push_back(V->getCanonicalDecl());
+
+      // __attribute__((used)) keeps the variable in the binary
+      if (V->hasAttr<UsedAttr>())
+        handleVarUse(V, Result.SourceManager);
+
     } else if (const auto *R = Result.Nodes.getNodeAs<DeclRefExpr>("declRef")) {
-      handleUse(R->getDecl(), Result.SourceManager);
+      if (const auto *ECD = dyn_cast<EnumConstantDecl>(R->getDecl()))
+        handleTypeUse(ECD, R->getLocation(), Result.SourceManager);
+      else
+        handleUse(R->getDecl(), Result.SourceManager,
+                  getCaller(*R, *Result.Context), R->getLocation());
+    } else if (const auto *RD =
+                   Result.Nodes.getNodeAs<CXXRecordDecl>("classDef")) {
+      // For -could-be-final and -virtual-families.
+      handleClassDef(RD, Result.SourceManager);
+    } else if (const auto *T = Result.Nodes.getNodeAs<NamedDecl>("typeDecl")) {
+      handleTypeDef(T, Result.SourceManager);
+    } else if (const auto *TL = Result.Nodes.getNodeAs<TypeLoc>("typeLoc")) {
+      if (const NamedDecl *D = getReferencedType(TL->getTypePtr()))
+        handleTypeUse(D, TL->getBeginLoc(), Result.SourceManager);
     } else if (const auto *R =
                    Result.Nodes.getNodeAs<MemberExpr>("memberRef")) {
-      handleUse(R->getMemberDecl(), Result.SourceManager);
+      handleUse(R->getMemberDecl(), Result.SourceManager,
+                getCaller(*R, *Result.Context), R->getMemberLoc());
     } else if (const auto *R = Result.Nodes.getNodeAs<CXXConstructExpr>(
                    "cxxConstructExpr")) {
-      handleUse(R->getConstructor(), Result.SourceManager);
+      handleUse(R->getConstructor(), Result.SourceManager,
+                getCaller(*R, *Result.Context), R->getLocation());
     }
   }
 
-  std::set<const FunctionDecl *> Defs;
-  std::set<const FunctionDecl *> Uses;
+  ArenaVector<const Decl *> Defs;
+  ArenaVector<const Decl *> Uses;
+  ArenaVector<const NamedDecl *> TypeDefs;
+  ArenaVector<const NamedDecl *> TypeUses;
+
+  using MacroRef = std::pair<const MacroInfo *, const IdentifierInfo *>;
+  ArenaVector<MacroRef> MacroDefs;
+  ArenaVector<MacroRef> MacroUses;
+
+  /// The library of this TU for -could-be-hidden, or 0.
+  uint32_t Library = 0;
+  /// The category of this TU for -category-map, or 0.
+  uint32_t Category = 0;
+  /// The bit of the component of this TU for -component-map, or 0.
+  uint64_t ComponentBit = 0;
+
+  /// Caller and callee, for -reachability.
+  using CallEdge = std::pair<const FunctionDecl *, const FunctionDecl *>;
+  ArenaVector<CallEdge> CallEdges;
+
+  /// Callee, location and caller of each reference, for -call-sites.
+  using Reference = std::tuple<const FunctionDecl *, SourceLocation,
+                               const FunctionDecl *>;
+  ArenaVector<Reference> References;
+
+  /// Classes and virtual methods that could be final, and those that are
+  /// derived from or overridden, for -could-be-final.
+  ArenaVector<const NamedDecl *> FinalCandidates;
+  ArenaVector<const NamedDecl *> Overridden;
+
+  /// Virtual methods, their override edges, and the methods that override
+  /// methods of system classes, for -virtual-families.
+  ArenaVector<const FunctionDecl *> VirtualMethods;
+  ArenaVector<CallEdge> FamilyEdges;
+  ArenaVector<const FunctionDecl *> FamilyRoots;
+
+  /// Inline and template functions defined in headers, and the headers this
+  /// TU includes, for -header-functions and -header-waste.
+  ArenaVector<const FunctionDecl *> HeaderFunctionDefs;
+  ArenaVector<FileID> IncludedFiles;
+
+  /// Definitions that -exported-symbols exports, and the mangler for the
+  /// names of definitions, for -exported-symbols and -profile.
+  ArenaVector<const Decl *> ExportedDecls;
+  std::unique_ptr<MangleContext> Mangler;
+
+  /// Symbol, location and caller of each use, for -index-file.
+  using IndexRef =
+      std::tuple<const Decl *, SourceLocation, const FunctionDecl *>;
+  ArenaVector<IndexRef> IndexRefs;
+};
+
+/// Records macro definitions and uses for -macros, and the included headers
+/// for -header-functions. The preprocessor runs anyway, so this comes at no
+/// extra parsing cost.
+class XUnusedPPCallbacks : public PPCallbacks {
+public:
+  XUnusedPPCallbacks(FunctionDeclMatchHandler &Handler,
+                     const SourceManager &SM)
+      : Handler(Handler), SM(SM) {}
+
+  void FileChanged(SourceLocation Loc, FileChangeReason Reason,
+                   SrcMgr::CharacteristicKind FileType,
+                   FileID /*PrevFID*/) override {
+    if (Reason == EnterFile)
+      Handler.handleFileEntered(Loc, FileType, SM);
+  }
+
+  void MacroDefined(const Token &MacroNameTok,
+                    const MacroDirective *MD) override {
+    Handler.handleMacroDef(MacroNameTok, MD->getMacroInfo(), SM);
+  }
+  void MacroExpands(const Token &MacroNameTok, const MacroDefinition &MD,
+                    SourceRange /*Range*/, const MacroArgs * /*Args*/) override {
+    Handler.handleMacroUse(MacroNameTok, MD, SM);
+  }
+  void Defined(const Token &MacroNameTok, const MacroDefinition &MD,
+               SourceRange /*Range*/) override {
+    Handler.handleMacroUse(MacroNameTok, MD, SM);
+  }
+  void Ifdef(SourceLocation /*Loc*/, const Token &MacroNameTok,
+             const MacroDefinition &MD) override {
+    Handler.handleMacroUse(MacroNameTok, MD, SM);
+  }
+  void Ifndef(SourceLocation /*Loc*/, const Token &MacroNameTok,
+              const MacroDefinition &MD) override {
+    Handler.handleMacroUse(MacroNameTok, MD, SM);
+  }
+#if CLANG_VERSION_MAJOR >= 14
+  using PPCallbacks::Elifdef;
+  using PPCallbacks::Elifndef;
+  void Elifdef(SourceLocation /*Loc*/, const Token &MacroNameTok,
+               const MacroDefinition &MD) override {
+    Handler.handleMacroUse(MacroNameTok, MD, SM);
+  }
+  void Elifndef(SourceLocation /*Loc*/, const Token &MacroNameTok,
+                const MacroDefinition &MD) override {
+    Handler.handleMacroUse(MacroNameTok, MD, SM);
+  }
+#endif
+
+private:
+  FunctionDeclMatchHandler &Handler;
+  const SourceManager &SM;
 };
 
 class XUnusedASTConsumer : public ASTConsumer {
@@ -215,16 +4067,34 @@ public:
     Matcher.addMatcher(
         functionDecl(isDefinition(), unless(isImplicit())).bind("fnDecl"),
         &Handler);
+    if (trackVariables())
+      Matcher.addMatcher(varDecl(isDefinition(), hasGlobalStorage(),
+                                 unless(isImplicit()))
+                             .bind("varDecl"),
+                         &Handler);
     Matcher.addMatcher(declRefExpr().bind("declRef"), &Handler);
     Matcher.addMatcher(memberExpr().bind("memberRef"), &Handler);
+    if (CouldBeFinal || VirtualFamilies)
+      Matcher.addMatcher(cxxRecordDecl(isDefinition()).bind("classDef"),
+                         &Handler);
+    if (Types) {
+      Matcher.addMatcher(tagDecl(isDefinition()).bind("typeDecl"), &Handler);
+      Matcher.addMatcher(typedefNameDecl().bind("typeDecl"), &Handler);
+      Matcher.addMatcher(enumConstantDecl().bind("typeDecl"), &Handler);
+      Matcher.addMatcher(typeLoc().bind("typeLoc"), &Handler);
+    }
     Matcher.addMatcher(cxxConstructExpr().bind("cxxConstructExpr"), &Handler);
   }
 
   void HandleTranslationUnit(ASTContext &Context) override {
     Matcher.matchAST(Context);
     Handler.finalize(Context.getSourceManager());
+    LastASTMemory = Context.getASTAllocatedMemory() +
+                    Context.getSideTableAllocatedMemory();
   }
 
+  FunctionDeclMatchHandler &getHandler() { return Handler; }
+
 private:
   FunctionDeclMatchHandler Handler;
   MatchFinder Matcher;
@@ -233,32 +4103,187 @@ private:
 // For each source file provided to the tool, a new FrontendAction is created.
 class XUnusedFrontendAction : public ASTFrontendAction {
 public:
-  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance & /*CI*/,
-                                                 StringRef /*File*/) override {
-    return std::make_unique<XUnusedASTConsumer>();
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef File) override {
+    auto Consumer = std::make_unique<XUnusedASTConsumer>();
+    SmallString<256> Path(File);
+    CI.getFileManager().makeAbsolutePath(Path);
+    if (CouldBeHidden && !LibraryMapFile.empty()) {
+      Consumer->getHandler().Library = Libraries.getId(Path);
+    } else if (CouldBeHidden) {
+      SmallString<256> MainFile(Path);
+      llvm::sys::path::remove_dots(MainFile, /*remove_dot_dot=*/true);
+      Consumer->getHandler().Library = OutputLibraries.lookup(MainFile);
+    }
+    if (!CategoryMapFile.empty())
+      Consumer->getHandler().Category = Categories.getId(Path);
+    if (!ComponentMapFile.empty()) {
+      SmallString<256> MainFile(Path);
+      llvm::sys::path::remove_dots(MainFile, /*remove_dot_dot=*/true);
+      Consumer->getHandler().ComponentBit =
+          ComponentMap::getBit(Components.getComponent(MainFile));
+    }
+    if (Macros || HeaderFunctions || HeaderWaste)
+      CI.getPreprocessor().addPPCallbacks(std::make_unique<XUnusedPPCallbacks>(
+          Consumer->getHandler(), CI.getSourceManager()));
+    return Consumer;
   }
 };
 
 class XUnusedFrontendActionFactory : public tooling::FrontendActionFactory {
 public:
   std::unique_ptr<FrontendAction> create() override { return std::make_unique<XUnusedFrontendAction>(); }
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    bool Success = tooling::FrontendActionFactory::runInvocation(
+        std::move(Invocation), Files, std::move(PCHContainerOps),
+        DiagConsumer);
+    // The AST of the translation unit has been freed by now.
+    trimHeapAfterTU();
+    return Success;
+  }
 };
 
+/// Implements 'xunused why <symbol> -index-file=<file>'.
+int runWhy(int argc, const char **argv) {
+  if (argc < 3) {
+    llvm::errs() << "usage: " << argv[0]
+                 << " why <qualified name> -index-file=<file>\n";
+    return 1;
+  }
+  std::vector<const char *> Args{argv[0]};
+  Args.insert(Args.end(), argv + 3, argv + argc);
+  llvm::cl::ParseCommandLineOptions(Args.size(), Args.data());
+  if (IndexFile.empty()) {
+    llvm::errs() << "error: 'why' needs -index-file\n";
+    return 1;
+  }
+  if (auto Err = ReferenceIndex::query(IndexFile, argv[2], llvm::outs())) {
+    llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+/// Creates the executor that --executor names.
+llvm::Expected<std::unique_ptr<tooling::ToolExecutor>>
+createExecutor(tooling::CommonOptionsParser &Options) {
+  for (const auto &Entry : tooling::ToolExecutorPluginRegistry::entries()) {
+    if (Entry.getName() != tooling::ExecutorName)
+      continue;
+    std::unique_ptr<tooling::ToolExecutorPlugin> Plugin(Entry.instantiate());
+    return Plugin->create(Options);
+  }
+  return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                 "executor '%s' is not registered",
+                                 tooling::ExecutorName.getValue().c_str());
+}
+
 int main(int argc, const char **argv) {
   llvm::sys::PrintStackTraceOnErrorSignal(argv[0]);
 
+  if (argc > 1 && StringRef(argv[1]) == "why")
+    return runWhy(argc, argv);
+
   const char *Overview = R"(
   xunused is tool to find unused functions and methods across a whole C/C++ project.
   )";
 
+  DebugUSRs.OnConflict = [](StringRef USR, const SymbolHash &,
+                            const SymbolHash &) {
+    llvm::errs() << "error: USR '" << USR << "' has two different hashes\n";
+    ++DebugUSRMismatches;
+  };
+
   tooling::ExecutorName.setInitialValue("all-TUs");
 #if 1
-  auto Executor = clang::tooling::createExecutorFromCommandLineArgs(
-      argc, argv, llvm::cl::getGeneralCategory(), Overview);
+  // Like tooling::createExecutorFromCommandLineArgs, but keeps the options
+  // parser, which owns the compilation database.
+  auto Options = tooling::CommonOptionsParser::create(
+      argc, argv, llvm::cl::getGeneralCategory(), llvm::cl::ZeroOrMore,
+      Overview);
+  if (!Options) {
+    llvm::errs() << llvm::toString(Options.takeError()) << "\n";
+    return 1;
+  }
+  auto Executor = createExecutor(*Options);
   if (!Executor) {
     llvm::errs() << llvm::toString(Executor.takeError()) << "\n";
     return 1;
   }
+  if (CouldBeHidden && !LibraryMapFile.empty()) {
+    if (auto Err = Libraries.load(LibraryMapFile)) {
+      llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+  } else if (CouldBeHidden &&
+             !loadOutputLibraries(Options->getCompilations())) {
+    llvm::errs() << "error: -could-be-hidden needs -library-map, or compile "
+                    "commands with output paths\n";
+    return 1;
+  }
+
+  if (!CategoryMapFile.empty()) {
+    if (auto Err = Categories.load(CategoryMapFile)) {
+      llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+    if (Categories.size() > MaxCategories) {
+      llvm::errs() << "error: -category-map has more than " << MaxCategories
+                   << " categories\n";
+      return 1;
+    }
+  }
+
+  if (!ComponentMapFile.empty())
+    if (auto Err = Components.load(ComponentMapFile)) {
+      llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+
+  for (const std::string &File : ExportedSymbolFiles)
+    if (auto Err = Exports.load(File)) {
+      llvm::errs() << "error: " << File << ": "
+                   << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+  if (auto Err = Exports.finish()) {
+    llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+    return 1;
+  }
+
+  if (SortByCompileTime && TimeTraces.empty()) {
+    llvm::errs() << "error: -sort-by-compile-time needs -time-trace\n";
+    return 1;
+  }
+  if (!ProfileFile.empty())
+    if (auto Err = Profile.load(ProfileFile)) {
+      llvm::errs() << "error: " << ProfileFile << ": "
+                   << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+
+  for (const std::string &Path : TimeTraces)
+    if (auto Err = FrontendTimes.load(Path)) {
+      llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+
+  if (!Roots.empty()) {
+    std::string Pattern;
+    for (const std::string &Root : Roots)
+      Pattern += (Pattern.empty() ? "^(" : "|(") + Root + ")";
+    RootRegex = std::make_unique<llvm::Regex>(Pattern + "$");
+    std::string Error;
+    if (!RootRegex->isValid(Error)) {
+      llvm::errs() << "error: invalid -root pattern: " << Error << "\n";
+      return 1;
+    }
+  }
+
   auto Err =
       Executor->get()->execute(std::unique_ptr<XUnusedFrontendActionFactory>(
           new XUnusedFrontendActionFactory()));
@@ -274,15 +4299,328 @@ int main(int argc, const char **argv) {
     llvm::errs() << llvm::toString(std::move(Err)) << "\n";
   }
 
-  for (auto &KV : AllDecls) {
-    DefInfo &I = KV.second;
-    if (I.Definition && I.Uses == 0) {
-      llvm::errs() << I.Filename << ":" << I.Line << ": warning:"
-                   << " Function '" << I.Name << "' is unused\n";
-      for (auto &D : I.Declarations) {
-        llvm::errs() << D.Filename << ":" << D.Line << ": note:"
-                     << " declared here\n";
+  std::vector<std::pair<SymbolHash, size_t>> USRsByHash;
+  if (DebugUSR)
+    USRsByHash = checkDebugUSRs();
+
+  // Definitions whose symbol name -scan found are used, and roots with
+  // -reachability. Without it, only the unused ones need to be searched.
+  llvm::DenseSet<SymbolHash> ScannedUses;
+  if (!ScanPaths.empty()) {
+    SymbolScanner Scanner;
+    std::vector<std::pair<SymbolHash, uint32_t>> Candidates;
+    if (auto Err =
+            AllDecls.forEachSymbol([&](const SymbolHash &Hash, DefInfo &I) {
+              if (I.Defined && !I.SymbolName.empty() &&
+                  (Reachability || !I.Uses))
+                Candidates.emplace_back(Hash, Scanner.add(I.SymbolName));
+            })) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+    if (auto Err = Scanner.scan(ScanPaths)) {
+      llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+    for (const auto &C : Candidates) {
+      if (!Scanner.isFound(C.second))
+        continue;
+      ScannedUses.insert(C.first);
+      if (Reachability)
+        Calls.addEdge(CallGraph::Root, Calls.getNode(C.first));
+    }
+    if (PrintStats)
+      llvm::errs() << "note: scanned " << Scanner.getBytesScanned()
+                   << " bytes in " << Scanner.getFilesScanned()
+                   << " files and found " << ScannedUses.size() << " of "
+                   << Candidates.size() << " symbol names\n";
+  }
+
+  std::vector<uint32_t> DeadComponentSizes;
+  if (Reachability) {
+    Calls.computeReachable();
+    DeadComponentSizes = Calls.getDeadComponentSizes();
+  }
+  auto IsUnused = [&](const SymbolHash &Hash, const DefInfo &I) {
+    if (ScannedUses.count(Hash))
+      return false;
+    if (!Reachability || I.Kind != SymbolKind::Function)
+      return I.Uses == 0;
+    uint32_t Node;
+    return !Calls.lookup(Hash, Node) || !Calls.isReachable(Node);
+  };
+
+  // Returns what to report about a symbol, one message per analysis that
+  // applies; empty if there is nothing to report.
+  auto GetFindings = [&](const SymbolHash &Hash,
+                         const DefInfo &I) -> std::vector<std::string> {
+    std::string What =
+        std::string(getKindName(I.Kind)) + " '" + I.Name + "' is ";
+    std::vector<std::string> Messages;
+    if (I.Defined && IsUnused(Hash, I)) {
+      if (StaticInitializers && !I.DynamicInit)
+        return Messages;
+      Messages.push_back(What + (Reachability && I.Kind == SymbolKind::Function
+                                     ? "unreachable"
+                                     : "unused"));
+      return Messages;
+    }
+    if (StaticInitializers)
+      return Messages;
+    if (CouldBeFinal && I.CanBeFinal && !I.Overridden)
+      Messages.push_back(What + (I.Kind == SymbolKind::Type
+                                     ? "never derived from and could be final"
+                                     : "never overridden and could be final "
+                                       "or non-virtual"));
+    if (I.NeverExecuted && I.Defined)
+      Messages.push_back(What + (Reachability ? "reachable" : "used") +
+                         " but never executed in the profile");
+    // Exported symbols are used from outside of the project.
+    if (I.Exported)
+      return Messages;
+    if (HeaderFunctions && I.HeaderFunction && !I.Defined &&
+        I.UserTUs.State == UniqueId::One &&
+        IncludeFanOut.lookup(I.Filename) > 1)
+      Messages.push_back(What + "defined in a header but only used by one "
+                                "translation unit");
+    if (!I.Defined)
+      return Messages;
+    if (CouldBeStatic && I.CanBeInternal && I.UserTUs.isOnly(I.DefTU))
+      Messages.push_back(What + "only used in its own translation unit and "
+                                "could be static");
+    if (CouldBeHidden && I.CanBeHidden && I.DefLibrary &&
+        I.UserLibraries.isOnly(I.DefLibrary))
+      Messages.push_back(What + "only used in library '" +
+                         Libraries.getName(I.DefLibrary).str() +
+                         "' and could be hidden");
+    if (!CategoryMapFile.empty() && I.UserCategories &&
+        !(I.UserCategories & (1u << I.DefCategory)))
+      Messages.push_back(What + "only used from " +
+                         getCategoryNames(I.UserCategories));
+    if (!ComponentMapFile.empty() && I.DefComponent &&
+        (I.Kind == SymbolKind::Function || I.Kind == SymbolKind::Variable) &&
+        !(I.UserComponents & Components.getInternalMask(I.DefComponent)))
+      Messages.push_back(What + "only used from outside of component '" +
+                         Components.getName(I.DefComponent).str() + "'");
+    if (CallSites && I.Kind == SymbolKind::Function && !I.HeaderReferences &&
+        I.References && I.References <= CallSites) {
+      if (I.References > 1)
+        Messages.push_back(What + "only referenced " +
+                           std::to_string(I.References) + " times");
+      else
+        Messages.push_back(What + "only referenced once, " +
+                           (I.Caller.empty()
+                                ? std::string("outside of any function")
+                                : "from '" + I.Caller + "'"));
+    }
+    return Messages;
+  };
+
+  // Unused definitions and declarations per header, for -header-waste.
+  // Declarations count as one line each. Definitions, declarations and
+  // IncludeFanOut all use getNormalizedFilename, so the names match.
+  struct HeaderCost {
+    uint64_t Lines = 0;
+    uint64_t Symbols = 0;
+  };
+  llvm::StringMap<HeaderCost> HeaderCosts;
+  auto AddHeaderCost = [&](StringRef Filename, unsigned Lines) {
+    if (!IncludeFanOut.count(Filename))
+      return; // Not a header.
+    HeaderCost &C = HeaderCosts[Filename];
+    C.Lines += std::max(Lines, 1u);
+    ++C.Symbols;
+  };
+  auto AddHeaderWaste = [&](const SymbolHash &Hash, const DefInfo &I) {
+    if (I.Defined ? !IsUnused(Hash, I) : !I.HeaderFunction || I.Uses)
+      return;
+    AddHeaderCost(I.Filename, I.Lines);
+    for (const DeclLoc &D : I.Declarations)
+      AddHeaderCost(D.Filename, 1);
+  };
+
+  struct Finding {
+    SymbolHash Hash;
+    DefInfo Info;
+    std::vector<std::string> Messages;
+    CompileTimes::Cost Time; // With -time-trace.
+  };
+
+  // AllDecls is ordered by hash; report in source order instead, or the
+  // largest functions first with -sort-by-size.
+  std::vector<Finding> Findings;
+  // Time traces name declarations without their parameters, so overloads
+  // and specializations share their costs. Only definitions whose name is
+  // unique in the project get the time of that name.
+  llvm::StringMap<uint32_t> DefinitionsByName;
+  if (auto Err =
+          AllDecls.forEachSymbol([&](const SymbolHash &Hash, DefInfo &I) {
+            if (HeaderWaste)
+              AddHeaderWaste(Hash, I);
+            if (I.Defined && FrontendTimes.lookup(I.Name).Micros)
+              ++DefinitionsByName[I.Name];
+            std::vector<std::string> Messages = GetFindings(Hash, I);
+            if (Messages.empty())
+              return;
+            Findings.push_back({Hash, std::move(I), std::move(Messages), {}});
+          })) {
+    llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+    return 1;
+  }
+  for (Finding &F : Findings)
+    if (DefinitionsByName.lookup(F.Info.Name) == 1)
+      F.Time = FrontendTimes.lookup(F.Info.Name);
+  std::sort(Findings.begin(), Findings.end(), [](const Finding &A,
+                                                 const Finding &B) {
+    if (SortByCompileTime && A.Time.Micros != B.Time.Micros)
+      return A.Time.Micros > B.Time.Micros;
+    if (SortBySize && A.Info.Size != B.Info.Size)
+      return A.Info.Size > B.Info.Size;
+    return std::tie(A.Info.Filename, A.Info.Line, A.Info.Name) <
+           std::tie(B.Info.Filename, B.Info.Line, B.Info.Name);
+  });
+
+  for (const Finding &F : Findings) {
+    const DefInfo &I = F.Info;
+    for (const std::string &Message : F.Messages)
+      llvm::errs() << I.Filename << ":" << I.Line << ": warning: " << Message
+                   << "\n";
+    uint32_t Node;
+    if (Reachability && Calls.lookup(F.Hash, Node) &&
+        DeadComponentSizes[Node] > 1)
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " part of a cycle of " << DeadComponentSizes[Node]
+                   << " unreachable functions\n";
+    if (I.Kind == SymbolKind::Type || I.Kind == SymbolKind::Macro)
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " its definition is parsed by " << I.IncludingTUs
+                   << " translation units\n";
+    if (F.Time.Micros)
+      llvm::errs() << I.Filename << ":" << I.Line << ": note: "
+                   << llvm::format("%.1f", F.Time.Micros / 1000.0)
+                   << " ms of frontend time in " << F.Time.TUs
+                   << " translation units\n";
+    if (SortBySize && I.Size)
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " its body has " << I.Size << " AST nodes\n";
+    if (I.HeaderFunction && !I.Defined) {
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " its header is included by "
+                   << IncludeFanOut.lookup(I.Filename)
+                   << " translation units\n";
+      if (I.UserTUs.Id < TUFiles.size())
+        llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                     << " only used by '" << TUFiles[I.UserTUs.Id] << "'\n";
+    }
+    if (I.DynamicInit)
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " its dynamic initializer runs at program startup\n";
+    if (!I.InitCallees.empty()) {
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " the initializer calls";
+      for (size_t C = 0; C != I.InitCallees.size(); ++C)
+        llvm::errs() << (C ? ", '" : " '") << I.InitCallees[C] << "'";
+      llvm::errs() << "\n";
+    }
+    for (auto &D : I.Declarations) {
+      llvm::errs() << D.Filename << ":" << D.Line << ": note:"
+                   << " declared here\n";
+    }
+    if (DebugUSR) {
+      auto It = std::lower_bound(USRsByHash.begin(), USRsByHash.end(),
+                                 std::make_pair(F.Hash, size_t(0)));
+      SmallString<256> USR;
+      if (It != USRsByHash.end() && It->first == F.Hash)
+        DebugUSRs.getString(It->second, USR);
+      llvm::errs() << I.Filename << ":" << I.Line << ": note:"
+                   << " USR is '" << USR << "'\n";
+    }
+  }
+
+  if (VirtualFamilies) {
+    auto Unused = Families.getUnusedFamilies();
+    std::sort(Unused.begin(), Unused.end(), [&](const auto &A, const auto &B) {
+      const auto &MA = Families.getMember(A.front());
+      const auto &MB = Families.getMember(B.front());
+      return std::tie(MA.Filename, MA.Line, MA.Name) <
+             std::tie(MB.Filename, MB.Line, MB.Name);
+    });
+    for (const auto &Family : Unused) {
+      const auto &Base = Families.getMember(Family.front());
+      // Methods that are only referenced, like those of classes declared
+      // outside of the project, have no name.
+      if (Base.Name.empty())
+        continue;
+      llvm::errs() << Base.Filename << ":" << Base.Line << ": warning:"
+                   << " Virtual method '" << Base.Name << "'";
+      if (Family.size() > 1)
+        llvm::errs() << " and its " << Family.size() - 1 << " overriders are";
+      else
+        llvm::errs() << " is";
+      llvm::errs() << " never called\n";
+      for (size_t N = 1; N != Family.size(); ++N) {
+        const auto &M = Families.getMember(Family[N]);
+        llvm::errs() << M.Filename << ":" << M.Line << ": note:"
+                     << " overrider '" << M.Name << "'\n";
       }
     }
   }
+
+  if (HeaderWaste) {
+    struct HeaderWasteEntry {
+      StringRef Filename;
+      uint32_t FanOut;
+      HeaderCost Cost;
+      uint64_t getWaste() const { return FanOut * Cost.Lines; }
+    };
+    std::vector<HeaderWasteEntry> Headers;
+    for (const auto &KV : HeaderCosts)
+      Headers.push_back(
+          {KV.getKey(), IncludeFanOut.lookup(KV.getKey()), KV.getValue()});
+    std::sort(Headers.begin(), Headers.end(),
+              [](const HeaderWasteEntry &A, const HeaderWasteEntry &B) {
+                return std::make_tuple(B.getWaste(), A.Filename) <
+                       std::make_tuple(A.getWaste(), B.Filename);
+              });
+    for (const HeaderWasteEntry &H : Headers)
+      llvm::errs() << H.Filename << ":1: warning: Header is included by "
+                   << H.FanOut << " translation units and has "
+                   << H.Cost.Lines << " lines of unused code in "
+                   << H.Cost.Symbols << " declarations, " << H.getWaste()
+                   << " lines parsed in vain\n";
+  }
+
+  if (!IndexFile.empty())
+    if (auto Err = Index.write(IndexFile)) {
+      llvm::errs() << "error: " << llvm::toString(std::move(Err)) << "\n";
+      return 1;
+    }
+
+  if (PrintStats) {
+    llvm::errs() << "note: " << Stats.TUs << " translation units allocated "
+                 << Stats.ArenaBytes << " bytes of summaries from arenas, at "
+                 << "most " << Stats.PeakArenaBytes
+                 << " bytes per translation unit; the heap was trimmed "
+                 << Stats.HeapTrims << " times\n";
+    if (!IndexFile.empty())
+      llvm::errs() << "note: the index has " << Index.size()
+                   << " references\n";
+    if (!ExportedSymbolFiles.empty())
+      llvm::errs() << "note: loaded " << Exports.size()
+                   << " exported symbol names\n";
+    if (Reachability)
+      llvm::errs() << "note: the call graph has " << Calls.getNumEdges()
+                   << " edges\n";
+  }
+  if (DebugUSR) {
+    llvm::errs() << "note: kept " << DebugUSRs.size() << " USRs in "
+                 << DebugUSRs.getMemorySize() << " bytes ("
+                 << DebugUSRs.getUncompressedSize()
+                 << " bytes as separate strings)\n";
+  }
+  if (DebugUSR && DebugUSRMismatches) {
+    llvm::errs() << "error: " << DebugUSRMismatches
+                 << " symbol hashes did not match their USR\n";
+    return 1;
+  }
 }